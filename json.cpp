@@ -1,6 +1,10 @@
 #include "json.hpp"
 
+#include <algorithm>
 #include <cctype> // для функции isalpha
+#include <charconv>
+#include <cmath>
+#include <functional>
 #include <utility>
 
 using namespace std;
@@ -440,6 +444,378 @@ Document Load(istream& input) {
     return Document{LoadNode(input)};
 }
 
+namespace {
+
+    // Потоковый разбор строго по грамматике JSON. Читает напрямую из
+    // streambuf, а строки и числа собирает в один переиспользуемый буфер
+    class EventParser {
+    public:
+        EventParser(istream& input, Handler& handler, size_t max_depth)
+            : input_(input)
+            , buffer_(*input.rdbuf())
+            , handler_(handler)
+            , max_depth_(max_depth) {
+        }
+
+        void Run() {
+            ParseValue();
+        }
+
+    private:
+        static constexpr int END = char_traits<char>::eof();
+
+        istream& input_;
+        streambuf& buffer_;
+        Handler& handler_;
+        const size_t max_depth_;
+        size_t depth_ = 0;
+        string token_;
+
+        int Peek() {
+            return buffer_.sgetc();
+        }
+
+        int Next() {
+            return buffer_.sbumpc();
+        }
+
+        int PeekToken() {
+            int ch = Peek();
+            while (ch == ' ' || ch == '\n' || ch == '\r' || ch == '\t') {
+                buffer_.sbumpc();
+                ch = Peek();
+            }
+            return ch;
+        }
+
+        [[noreturn]] void Fail(const string& message) {
+            input_.setstate(ios::failbit);
+            throw ParsingError(message);
+        }
+
+        void Expect(char expected) {
+            if (PeekToken() != expected) {
+                Fail("Expected '"s + expected + "'"s);
+            }
+            Next();
+        }
+
+        void ParseValue() {
+            switch (PeekToken()) {
+                case '{':
+                    ParseDict();
+                    break;
+                case '[':
+                    ParseArray();
+                    break;
+                case '"':
+                    ParseString();
+                    handler_.String(token_);
+                    break;
+                case 't':
+                    ParseLiteral("true"sv);
+                    handler_.Bool(true);
+                    break;
+                case 'f':
+                    ParseLiteral("false"sv);
+                    handler_.Bool(false);
+                    break;
+                case 'n':
+                    ParseLiteral("null"sv);
+                    handler_.Null();
+                    break;
+                case END:
+                    Fail("Unexpected end of input"s);
+                default:
+                    ParseNumber();
+            }
+        }
+
+        // Рекурсия ограничена, чтобы вход вида [[[[... не исчерпал стек
+        void EnterContainer() {
+            if (++depth_ > max_depth_) {
+                Fail("Nesting is too deep"s);
+            }
+        }
+
+        void ParseDict() {
+            Next();
+            EnterContainer();
+            handler_.StartDict();
+            if (PeekToken() == '}') {
+                Next();
+                --depth_;
+                handler_.EndDict();
+                return;
+            }
+            while (true) {
+                if (PeekToken() != '"') {
+                    Fail("Dict key must be a string"s);
+                }
+                ParseString();
+                handler_.Key(token_);
+                Expect(':');
+                ParseValue();
+                const int ch = PeekToken();
+                Next();
+                if (ch == '}') {
+                    break;
+                }
+                if (ch != ',') {
+                    Fail("Expected ',' or '}' in dict"s);
+                }
+            }
+            --depth_;
+            handler_.EndDict();
+        }
+
+        void ParseArray() {
+            Next();
+            EnterContainer();
+            handler_.StartArray();
+            if (PeekToken() == ']') {
+                Next();
+                --depth_;
+                handler_.EndArray();
+                return;
+            }
+            while (true) {
+                ParseValue();
+                const int ch = PeekToken();
+                Next();
+                if (ch == ']') {
+                    break;
+                }
+                if (ch != ',') {
+                    Fail("Expected ',' or ']' in array"s);
+                }
+            }
+            --depth_;
+            handler_.EndArray();
+        }
+
+        void ParseLiteral(string_view literal) {
+            for (const char expected : literal) {
+                if (Next() != expected) {
+                    Fail("Unknown literal, expected "s + string(literal));
+                }
+            }
+        }
+
+        // Код из четырёх шестнадцатеричных цифр после \u
+        unsigned ParseHex4() {
+            unsigned code = 0;
+            for (int i = 0; i < 4; ++i) {
+                const int ch = Next();
+                code <<= 4;
+                if (ch >= '0' && ch <= '9') {
+                    code |= ch - '0';
+                } else if (ch >= 'a' && ch <= 'f') {
+                    code |= ch - 'a' + 10;
+                } else if (ch >= 'A' && ch <= 'F') {
+                    code |= ch - 'A' + 10;
+                } else {
+                    Fail("Invalid \\u escape"s);
+                }
+            }
+            return code;
+        }
+
+        void AppendUtf8(unsigned code) {
+            if (code < 0x80) {
+                token_ += static_cast<char>(code);
+            } else if (code < 0x800) {
+                token_ += static_cast<char>(0xC0 | (code >> 6));
+                token_ += static_cast<char>(0x80 | (code & 0x3F));
+            } else if (code < 0x10000) {
+                token_ += static_cast<char>(0xE0 | (code >> 12));
+                token_ += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                token_ += static_cast<char>(0x80 | (code & 0x3F));
+            } else {
+                token_ += static_cast<char>(0xF0 | (code >> 18));
+                token_ += static_cast<char>(0x80 | ((code >> 12) & 0x3F));
+                token_ += static_cast<char>(0x80 | ((code >> 6) & 0x3F));
+                token_ += static_cast<char>(0x80 | (code & 0x3F));
+            }
+        }
+
+        void ParseString() {
+            Next();
+            token_.clear();
+            while (true) {
+                const int ch = Next();
+                if (ch == END) {
+                    Fail("Unterminated string"s);
+                }
+                if (ch == '"') {
+                    return;
+                }
+                // Управляющие символы в строке допустимы только экранированными
+                if (ch == '\n' || ch == '\r') {
+                    Fail("Unexpected end of line"s);
+                }
+                if (ch < 0x20) {
+                    Fail("Unescaped control character in string"s);
+                }
+                if (ch != '\\') {
+                    token_ += static_cast<char>(ch);
+                    continue;
+                }
+                const int escaped = Next();
+                switch (escaped) {
+                    case '"':
+                    case '\\':
+                    case '/':
+                        token_ += static_cast<char>(escaped);
+                        break;
+                    case 'b':
+                        token_ += '\b';
+                        break;
+                    case 'f':
+                        token_ += '\f';
+                        break;
+                    case 'n':
+                        token_ += '\n';
+                        break;
+                    case 'r':
+                        token_ += '\r';
+                        break;
+                    case 't':
+                        token_ += '\t';
+                        break;
+                    case 'u': {
+                        unsigned code = ParseHex4();
+                        // Символ вне базовой плоскости записывается суррогатной парой
+                        if (code >= 0xD800 && code < 0xDC00 && Next() == '\\' && Next() == 'u') {
+                            const unsigned low = ParseHex4();
+                            if (low < 0xDC00 || low >= 0xE000) {
+                                Fail("Invalid surrogate pair"s);
+                            }
+                            code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                        } else if (code >= 0xD800 && code < 0xE000) {
+                            Fail("Invalid surrogate pair"s);
+                        }
+                        AppendUtf8(code);
+                        break;
+                    }
+                    default:
+                        Fail("Unrecognized escape sequence"s);
+                }
+            }
+        }
+
+        void ParseNumber() {
+            token_.clear();
+            auto read_digits = [this] {
+                if (!isdigit(Peek())) {
+                    Fail("A digit is expected"s);
+                }
+                while (isdigit(Peek())) {
+                    token_ += static_cast<char>(Next());
+                }
+            };
+
+            if (Peek() == '-') {
+                token_ += static_cast<char>(Next());
+            }
+            if (Peek() == '0') {
+                token_ += static_cast<char>(Next());
+            } else {
+                read_digits();
+            }
+            bool is_int = true;
+            if (Peek() == '.') {
+                token_ += static_cast<char>(Next());
+                read_digits();
+                is_int = false;
+            }
+            if (const int ch = Peek(); ch == 'e' || ch == 'E') {
+                token_ += static_cast<char>(Next());
+                if (const int sign = Peek(); sign == '+' || sign == '-') {
+                    token_ += static_cast<char>(Next());
+                }
+                read_digits();
+                is_int = false;
+            }
+
+            const char* begin = token_.data();
+            const char* end = begin + token_.size();
+            if (is_int) {
+                int value = 0;
+                // Целое, не влезающее в int, становится double, как в Load
+                if (auto [ptr, ec] = from_chars(begin, end, value); ec == errc() && ptr == end) {
+                    handler_.Int(value);
+                    return;
+                }
+            }
+            double value = 0.0;
+            if (auto [ptr, ec] = from_chars(begin, end, value); ec != errc() || ptr != end) {
+                Fail("Failed to convert "s + token_ + " to number"s);
+            }
+            handler_.Double(value);
+        }
+    };
+
+}  // namespace
+
+void Parse(istream& input, Handler& handler, size_t max_depth) {
+    EventParser(input, handler, max_depth).Run();
+}
+
+namespace {
+
+    // Кратчайшая запись, из которой double восстанавливается без потерь.
+    // В JSON нет бесконечностей и NaN, они печатаются как null
+    void PrintDouble(double value, ostream& output) {
+        if (!isfinite(value)) {
+            output << "null"sv;
+            return;
+        }
+        char buffer[32];
+        auto [end, ec] = to_chars(buffer, buffer + sizeof(buffer), value);
+        output.write(buffer, end - buffer);
+    }
+
+    void PrintString(const string& str, ostream& output) {
+        output << '"';
+        for (const char ch : str) {
+            switch (ch) {
+                case '"':
+                    output << "\\\""sv;
+                    break;
+                case '\\':
+                    output << "\\\\"sv;
+                    break;
+                case '\n':
+                    output << "\\n"sv;
+                    break;
+                case '\r':
+                    output << "\\r"sv;
+                    break;
+                case '\t':
+                    output << "\\t"sv;
+                    break;
+                case '\b':
+                    output << "\\b"sv;
+                    break;
+                case '\f':
+                    output << "\\f"sv;
+                    break;
+                default:
+                    // Остальные управляющие символы JSON допускает только как \u00XX
+                    if (static_cast<unsigned char>(ch) < 0x20) {
+                        static constexpr char HEX[] = "0123456789abcdef";
+                        output << "\\u00"sv << HEX[ch >> 4] << HEX[ch & 0xf];
+                    } else {
+                        output << ch;
+                    }
+            }
+        }
+        output << '"';
+    }
+
+}  // namespace
+
 ostream& operator<<(ostream& output, const Node& node) {
         if (node.IsNull()) {
             output << "null"s;
@@ -450,20 +826,11 @@ ostream& operator<<(ostream& output, const Node& node) {
         }
 
         else if (node.IsDouble()) {
-            output << std::hex << node.AsDouble();
+            PrintDouble(node.AsDouble(), output);
         }
 
         else if (node.IsString()) {
-            output << "\"";
-
-            for (const char& ch : node.AsString()) {
-                if (ch == '"') {
-                    output << "\\";
-                }
-                output << ch;
-            }
-
-            output << "\"";
+            PrintString(node.AsString(), output);
         }
 
         else if (node.IsBool()) {
@@ -497,7 +864,7 @@ ostream& operator<<(ostream& output, const Node& node) {
                 if (flag) {
                     output << ", "s << std::endl;
                 }
-                output << "\"" << dict.first << "\"";
+                PrintString(dict.first, output);
                 output << ": "s;
                 output << dict.second;
                 flag = true;
@@ -513,4 +880,142 @@ ostream& operator<<(ostream& output, const Node& node) {
         output << doc.GetRoot();
     }
 
+    namespace {
+
+        // Узел красно-чёрного дерева std::map хранит три указателя и цвет
+        // перед парой ключ-значение (libstdc++ и libc++)
+        constexpr size_t MAP_NODE_HEADER_BYTES = 4 * sizeof(void*);
+
+        // Байты в куче под буфер строки; 0, если строка умещается в SSO
+        size_t StringHeapBytes(const string& str) {
+            const char* data = str.data();
+            const char* self = reinterpret_cast<const char*>(&str);
+            std::less<const char*> less;
+            if (!less(data, self) && less(data, self + sizeof(str))) {
+                return 0;
+            }
+            return str.capacity() + 1;
+        }
+
+        void AppendPathToken(string& path, const string& token) {
+            path += '/';
+            for (char ch : token) {
+                if (ch == '~') {
+                    path += "~0"s;
+                } else if (ch == '/') {
+                    path += "~1"s;
+                } else {
+                    path += ch;
+                }
+            }
+        }
+
+        class MemoryMeter {
+        public:
+            explicit MemoryMeter(size_t top_n)
+                    : top_n_(top_n) {
+            }
+
+            // Память поддерева вместе с самим узлом
+            MemoryUsage Measure(const Node& node) {
+                MemoryUsage usage;
+                if (node.IsString()) {
+                    size_t heap = StringHeapBytes(node.AsString());
+                    usage.string_bytes = sizeof(Node) + heap;
+                    usage.allocations = heap > 0 ? 1 : 0;
+                } else if (node.IsArray()) {
+                    usage = MeasureArray(node.AsArray());
+                    Remember(usage);
+                } else if (node.IsMap()) {
+                    usage = MeasureDict(node.AsMap());
+                    Remember(usage);
+                } else {
+                    usage.number_bytes = sizeof(Node);
+                }
+                return usage;
+            }
+
+            vector<SubtreeUsage> TakeLargest() {
+                sort(largest_.begin(), largest_.end(), BySize);
+                return move(largest_);
+            }
+
+        private:
+            MemoryUsage MeasureArray(const Array& array) {
+                MemoryUsage usage;
+                usage.container_bytes = sizeof(Node) + (array.capacity() - array.size()) * sizeof(Node);
+                usage.allocations = array.capacity() > 0 ? 1 : 0;
+
+                const size_t path_size = path_.size();
+                for (size_t i = 0; i < array.size(); ++i) {
+                    path_ += '/';
+                    path_ += to_string(i);
+                    usage += Measure(array[i]);
+                    path_.resize(path_size);
+                }
+                return usage;
+            }
+
+            MemoryUsage MeasureDict(const Dict& dict) {
+                MemoryUsage usage;
+                usage.container_bytes = sizeof(Node) + dict.size() * MAP_NODE_HEADER_BYTES;
+                usage.allocations = dict.size();
+
+                const size_t path_size = path_.size();
+                for (const auto& [key, value] : dict) {
+                    size_t key_heap = StringHeapBytes(key);
+                    usage.key_bytes += sizeof(key) + key_heap;
+                    usage.allocations += key_heap > 0 ? 1 : 0;
+
+                    AppendPathToken(path_, key);
+                    usage += Measure(value);
+                    path_.resize(path_size);
+                }
+                return usage;
+            }
+
+            static bool BySize(const SubtreeUsage& lhs, const SubtreeUsage& rhs) {
+                return lhs.usage.TotalBytes() > rhs.usage.TotalBytes();
+            }
+
+            // Поддерживает в largest_ кучу из top_n_ самых крупных поддеревьев
+            void Remember(const MemoryUsage& usage) {
+                if (top_n_ == 0 || path_.empty()) {
+                    return;
+                }
+                if (largest_.size() == top_n_) {
+                    if (usage.TotalBytes() <= largest_.front().usage.TotalBytes()) {
+                        return;
+                    }
+                    pop_heap(largest_.begin(), largest_.end(), BySize);
+                    largest_.pop_back();
+                }
+                largest_.push_back({path_, usage});
+                push_heap(largest_.begin(), largest_.end(), BySize);
+            }
+
+            size_t top_n_;
+            string path_;
+            vector<SubtreeUsage> largest_;
+        };
+
+    }  // namespace
+
+    MemoryUsage& MemoryUsage::operator+=(const MemoryUsage& other) {
+        container_bytes += other.container_bytes;
+        key_bytes += other.key_bytes;
+        string_bytes += other.string_bytes;
+        number_bytes += other.number_bytes;
+        allocations += other.allocations;
+        return *this;
+    }
+
+    MemoryReport MeasureMemory(const Document& doc, size_t top_n) {
+        MemoryMeter meter(top_n);
+        MemoryReport report;
+        report.total = meter.Measure(doc.GetRoot());
+        report.largest_subtrees = meter.TakeLargest();
+        return report;
+    }
+
 }
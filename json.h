@@ -1,8 +1,10 @@
 #pragma once
 
+#include <cstddef>
 #include <iostream>
 #include <map>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <variant>
 
@@ -83,6 +85,77 @@ private:
     
 Document Load(std::istream& input);
 
+// Получатель событий потокового разбора. Значения приходят в порядке
+// следования в тексте, дерево Node не строится. Строки и ключи действительны
+// только во время вызова
+class Handler {
+public:
+    virtual void Null() = 0;
+    virtual void Bool(bool value) = 0;
+    virtual void Int(int value) = 0;
+    virtual void Double(double value) = 0;
+    virtual void String(std::string_view value) = 0;
+
+    virtual void StartArray() = 0;
+    virtual void EndArray() = 0;
+
+    virtual void StartDict() = 0;
+    virtual void Key(std::string_view key) = 0;
+    virtual void EndDict() = 0;
+
+    virtual ~Handler() = default;
+
+protected:
+    Handler() = default;
+    Handler(const Handler&) = default;
+    Handler& operator=(const Handler&) = default;
+};
+
+inline constexpr size_t DEFAULT_MAX_DEPTH = 512;
+
+// Разбирает из input одно значение JSON, передавая события handler.
+// Память не зависит от размера входа, кроме глубины вложенности и длины
+// самой длинной строки. Ошибки синтаксиса, неэкранированные управляющие
+// символы в строках и вложенность массивов и словарей глубже max_depth -
+// ParsingError; исключения обработчика проходят без изменений
+void Parse(std::istream& input, Handler& handler, size_t max_depth = DEFAULT_MAX_DEPTH);
+
 void Print(const Document& doc, std::ostream& output);
 
+// Оценка памяти, занимаемой узлами документа, с разбивкой по категориям.
+// Размеры считаются по capacity() контейнеров и строк, накладные расходы
+// самого аллокатора (заголовки блоков, выравнивание) не учитываются
+struct MemoryUsage {
+    // Служебная память: сами Node контейнеров, узлы std::map, запас vector
+    size_t container_bytes = 0;
+    // Ключи словарей: объекты std::string и их буферы в куче
+    size_t key_bytes = 0;
+    // Строковые значения: Node со строкой и её буфер в куче
+    size_t string_bytes = 0;
+    // Node с числами, bool и null
+    size_t number_bytes = 0;
+    // Количество выделений памяти в куче
+    size_t allocations = 0;
+
+    size_t TotalBytes() const {
+        return container_bytes + key_bytes + string_bytes + number_bytes;
+    }
+
+    MemoryUsage& operator+=(const MemoryUsage& other);
+};
+
+// Память, занимаемая поддеревом по пути в формате JSON Pointer ("/a/0/b")
+struct SubtreeUsage {
+    std::string path;
+    MemoryUsage usage;
+};
+
+struct MemoryReport {
+    MemoryUsage total;
+    // Самые крупные поддеревья (массивы и словари), по убыванию размера
+    std::vector<SubtreeUsage> largest_subtrees;
+};
+
+MemoryReport MeasureMemory(const Document& doc, size_t top_n = 10);
+
 }
@@ -1,26 +1,249 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <chrono>
+#include <cstdint>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <initializer_list>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "json.hpp"
+
+#ifdef __linux__
+#define PROFILE_HAS_PERF_EVENTS 1
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__)
+#define PROFILE_HAS_SAMPLING 1
+#include <cerrno>
+#include <csignal>
+#include <cxxabi.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <sys/time.h>
+#include <map>
+#include <unordered_map>
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#define PROFILE_HAS_TSC 1
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 
 #define PROFILE_CONCAT_INTERNAL(X, Y) X##Y
 #define PROFILE_CONCAT(X, Y) PROFILE_CONCAT_INTERNAL(X, Y)
 #define UNIQUE_VAR_NAME_PROFILE PROFILE_CONCAT(profileGuard, __LINE__)
+#define UNIQUE_SITE_NAME_PROFILE PROFILE_CONCAT(profileSite, __LINE__)
+
+// Агрегирующий замер: место вызова один раз регистрирует счётчик, а каждый
+// выход из области видимости только обновляет статистику текущего потока.
+// Сводка печатается через profile::Report или profile::ReportAtExit
+#define LOG_DURATION_AGGREGATE(x)                                   \
+    static const profile::Site UNIQUE_SITE_NAME_PROFILE(x);        \
+    profile::ScopeTimer UNIQUE_VAR_NAME_PROFILE(UNIQUE_SITE_NAME_PROFILE)
+
+// То же с числовыми аргументами для трассировки: LOG_DURATION_ARGS("load", {"bytes", n})
+#define LOG_DURATION_ARGS(x, ...)                                   \
+    static const profile::Site UNIQUE_SITE_NAME_PROFILE(x);        \
+    profile::ScopeTimer UNIQUE_VAR_NAME_PROFILE(UNIQUE_SITE_NAME_PROFILE, {__VA_ARGS__})
+
+// Агрегирующий замер с аппаратными счётчиками: такты, инструкции, промахи
+// кэша и предсказателя переходов. Без perf_event_open работает как
+// LOG_DURATION_AGGREGATE
+#define LOG_PERF_COUNTERS(x)                                        \
+    static const profile::Site UNIQUE_SITE_NAME_PROFILE(x);        \
+    profile::CounterScope UNIQUE_VAR_NAME_PROFILE(UNIQUE_SITE_NAME_PROFILE)
+
+// Агрегирующий замер с подсчётом выделений памяти в куче текущим потоком.
+// Считает только если ровно в одной единице трансляции перед подключением
+// profile.h определён PROFILE_DEFINE_ALLOCATION_HOOKS
+#define LOG_ALLOCATIONS(x)                                          \
+    static const profile::Site UNIQUE_SITE_NAME_PROFILE(x);        \
+    profile::AllocationScope UNIQUE_VAR_NAME_PROFILE(UNIQUE_SITE_NAME_PROFILE)
+
+// Замер с асинхронным выводом: деструктор кладёт запись фиксированного размера
+// в кольцевой буфер потока, а форматирует и пишет её фоновый поток,
+// запущенный profile::StartAsyncSink
+#define LOG_DURATION_ASYNC(x)                                       \
+    static const profile::Site UNIQUE_SITE_NAME_PROFILE(x);        \
+    profile::AsyncScope UNIQUE_VAR_NAME_PROFILE(UNIQUE_SITE_NAME_PROFILE)
+
+// С PROFILE_AGGREGATE все LOG_DURATION переключаются в агрегирующий режим
+#ifdef PROFILE_AGGREGATE
+#define LOG_DURATION(x) LOG_DURATION_AGGREGATE(x)
+#else
 #define LOG_DURATION(x) LogDuration UNIQUE_VAR_NAME_PROFILE(x)
+#endif
 #define LOG_DURATION_STREAM(x, y) LogDuration UNIQUE_VAR_NAME_PROFILE(x, y)
 
-class LogDuration {
+namespace profile {
+
+// Часы на счётчике тактов процессора: now() стоит единицы наносекунд против
+// десятков у steady_clock. Используются только при инвариантном TSC (частота
+// не зависит от энергосбережения и одинакова на всех ядрах), иначе now()
+// делегирует std::chrono::steady_clock
+class TscClock {
 public:
-    // заменим имя типа std::chrono::steady_clock
-    // с помощью using для удобства
-    using Clock = std::chrono::steady_clock;
+    using rep = int64_t;
+    using period = std::nano;
+    using duration = std::chrono::nanoseconds;
+    using time_point = std::chrono::time_point<TscClock>;
+    static constexpr bool is_steady = true;
+
+    static time_point now() noexcept {
+#ifdef PROFILE_HAS_TSC
+        const Calibration& calibration = GetCalibration();
+        if (calibration.enabled) {
+            const auto ticks = static_cast<int64_t>(ReadTicks(calibration.has_rdtscp) - calibration.base_ticks);
+            return time_point{duration{static_cast<rep>(static_cast<double>(ticks) * calibration.ns_per_tick)}};
+        }
+#endif
+        return time_point{std::chrono::duration_cast<duration>(
+            std::chrono::steady_clock::now().time_since_epoch())};
+    }
 
-    LogDuration(const std::string& id, std::ostream& dst_stream = std::cerr)
+    // true, если now() действительно читает TSC
+    static bool IsTscUsed() {
+#ifdef PROFILE_HAS_TSC
+        return GetCalibration().enabled;
+#else
+        return false;
+#endif
+    }
+
+    // Частота TSC в герцах, 0 при работе через steady_clock
+    static double Frequency() {
+#ifdef PROFILE_HAS_TSC
+        const Calibration& calibration = GetCalibration();
+        return calibration.enabled ? 1e9 / calibration.ns_per_tick : 0.0;
+#else
+        return 0.0;
+#endif
+    }
+
+    // Калибровка занимает несколько миллисекунд при первом вызове now();
+    // её можно провести заранее, при старте программы
+    static void Calibrate() {
+        IsTscUsed();
+    }
+
+private:
+#ifdef PROFILE_HAS_TSC
+    struct Calibration {
+        bool enabled = false;
+        bool has_rdtscp = false;
+        uint64_t base_ticks = 0;
+        double ns_per_tick = 0.0;
+    };
+
+    static uint64_t ReadTicks(bool has_rdtscp) noexcept {
+        if (has_rdtscp) {
+            unsigned int aux;
+            return __rdtscp(&aux);
+        }
+        _mm_lfence();
+        return __rdtsc();
+    }
+
+    static const Calibration& GetCalibration() noexcept {
+        static const Calibration calibration = MeasureFrequency(DetectFeatures());
+        return calibration;
+    }
+
+    static Calibration DetectFeatures() noexcept {
+        Calibration result;
+        unsigned int eax, ebx, ecx, edx;
+        if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)) {
+            result.has_rdtscp = (edx >> 27) & 1;
+        }
+        if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx)) {
+            result.enabled = (edx >> 8) & 1;
+        }
+        return result;
+    }
+
+    static Calibration MeasureFrequency(Calibration result) noexcept {
+        if (!result.enabled) {
+            return result;
+        }
+
+        // Номинальная частота из CPUID 0x15, если процессор её сообщает
+        unsigned int eax, ebx, ecx, edx;
+        if (__get_cpuid_max(0, nullptr) >= 0x15 && __get_cpuid(0x15, &eax, &ebx, &ecx, &edx)
+            && eax != 0 && ebx != 0 && ecx != 0) {
+            const double hz = static_cast<double>(ecx) * ebx / eax;
+            result.ns_per_tick = 1e9 / hz;
+        } else {
+            // Иначе сверяемся со steady_clock на интервале в 10 мс
+            using namespace std::chrono;
+            const auto start_time = steady_clock::now();
+            const uint64_t start_ticks = ReadTicks(result.has_rdtscp);
+            auto end_time = start_time;
+            while (end_time - start_time < 10ms) {
+                end_time = steady_clock::now();
+            }
+            const uint64_t end_ticks = ReadTicks(result.has_rdtscp);
+            const auto ns = duration_cast<nanoseconds>(end_time - start_time).count();
+            result.ns_per_tick = static_cast<double>(ns) / static_cast<double>(end_ticks - start_ticks);
+        }
+        result.base_ticks = ReadTicks(result.has_rdtscp);
+        return result;
+    }
+#endif
+};
+
+#ifdef PROFILE_USE_TSC
+using DefaultClock = TscClock;
+#else
+using DefaultClock = std::chrono::steady_clock;
+#endif
+
+// Средняя стоимость замера одной области видимости (пара вызовов now())
+// в наносекундах, для сравнения часов между собой
+template <typename Clock>
+double MeasureScopeOverhead(size_t iterations = 1'000'000) {
+    using namespace std::chrono;
+    typename Clock::duration sink{};
+    const auto start_time = steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i) {
+        const auto begin = Clock::now();
+        sink += Clock::now() - begin;
+    }
+    const auto dur = steady_clock::now() - start_time;
+    volatile auto keep = sink.count();
+    (void)keep;
+    return static_cast<double>(duration_cast<nanoseconds>(dur).count()) / static_cast<double>(iterations);
+}
+
+}  // namespace profile
+
+template <typename Clock>
+class BasicLogDuration {
+public:
+    BasicLogDuration(const std::string& id, std::ostream& dst_stream = std::cerr)
         : id_(id)
         , dst_stream_(dst_stream) {
     }
 
-    ~LogDuration() {
+    ~BasicLogDuration() {
         using namespace std::chrono;
         using namespace std::literals;
 
@@ -31,6 +254,1641 @@ public:
 
 private:
     const std::string id_;
-    const Clock::time_point start_time_ = Clock::now();
+    const typename Clock::time_point start_time_ = Clock::now();
     std::ostream& dst_stream_;
 };
+
+// Часы выбираются на этапе компиляции: с PROFILE_USE_TSC это profile::TscClock
+using LogDuration = BasicLogDuration<profile::DefaultClock>;
+
+namespace profile {
+
+#ifndef PROFILE_MAX_SITES
+#define PROFILE_MAX_SITES 1024
+#endif
+
+// Предел числа событий трассировки на поток, сверх него события отбрасываются
+#ifndef PROFILE_MAX_TRACE_EVENTS
+#define PROFILE_MAX_TRACE_EVENTS (1 << 20)
+#endif
+
+// Аппаратные счётчики, которые снимает LOG_PERF_COUNTERS
+enum class Counter {
+    CYCLES,
+    INSTRUCTIONS,
+    CACHE_MISSES,
+    BRANCH_MISSES,
+};
+
+inline constexpr size_t COUNTER_COUNT = 4;
+
+using CounterValues = std::array<uint64_t, COUNTER_COUNT>;
+
+// Лог-линейная гистограмма: каждая степень двойки делится на SUB_BUCKETS
+// равных интервалов, так что относительная погрешность не больше 1/SUB_BUCKETS
+class LatencyHistogram {
+public:
+    static constexpr int SUB_BUCKET_BITS = 3;
+    static constexpr uint64_t SUB_BUCKETS = uint64_t{1} << SUB_BUCKET_BITS;
+    static constexpr size_t BUCKET_COUNT = (64 - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+    static size_t BucketIndex(uint64_t value) {
+        if (value < SUB_BUCKETS) {
+            return static_cast<size_t>(value);
+        }
+        const int shift = HighestBit(value) - SUB_BUCKET_BITS;
+        const uint64_t mantissa = value >> shift;
+        return static_cast<size_t>((shift + 1) * SUB_BUCKETS + (mantissa - SUB_BUCKETS));
+    }
+
+    static uint64_t BucketUpperBound(size_t index) {
+        if (index < 2 * SUB_BUCKETS) {
+            return index;
+        }
+        const int shift = static_cast<int>(index / SUB_BUCKETS) - 1;
+        const uint64_t mantissa = SUB_BUCKETS + index % SUB_BUCKETS;
+        return ((mantissa + 1) << shift) - 1;
+    }
+
+private:
+    static int HighestBit(uint64_t value) {
+#if defined(__GNUC__) || defined(__clang__)
+        return 63 - __builtin_clzll(value);
+#else
+        int bit = 0;
+        while (value >>= 1) {
+            ++bit;
+        }
+        return bit;
+#endif
+    }
+};
+
+// Сводная статистика одного места вызова, все времена в наносекундах
+struct SiteStats {
+    std::string name;
+    uint64_t count = 0;
+    uint64_t total = 0;
+    uint64_t min = 0;
+    uint64_t max = 0;
+    std::vector<uint64_t> histogram = std::vector<uint64_t>(LatencyHistogram::BUCKET_COUNT);
+    // Вызовы, для которых удалось снять аппаратные счётчики, и их суммы
+    uint64_t counted = 0;
+    CounterValues counters{};
+
+    double CounterPerCall(Counter counter) const {
+        return counted == 0 ? 0.0 : static_cast<double>(counters[static_cast<size_t>(counter)]) / counted;
+    }
+
+    // Вызовы LOG_ALLOCATIONS и суммарные выделения памяти в них
+    uint64_t allocation_scopes = 0;
+    uint64_t allocations = 0;
+    uint64_t frees = 0;
+    uint64_t allocated_bytes = 0;
+
+    double InstructionsPerCycle() const {
+        const uint64_t cycles = counters[static_cast<size_t>(Counter::CYCLES)];
+        return cycles == 0 ? 0.0 : static_cast<double>(counters[static_cast<size_t>(Counter::INSTRUCTIONS)]) / cycles;
+    }
+
+    uint64_t Percentile(double quantile) const {
+        if (count == 0) {
+            return 0;
+        }
+        const auto rank = static_cast<uint64_t>(std::max(1.0, quantile * static_cast<double>(count) + 0.5));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < histogram.size(); ++i) {
+            seen += histogram[i];
+            if (seen >= rank) {
+                return std::clamp(LatencyHistogram::BucketUpperBound(i), min, max);
+            }
+        }
+        return max;
+    }
+};
+
+namespace detail {
+
+// Собственные выделения профилировщика (слоты, буферы трассировки, реестр)
+// делаются лениво, внутри пользовательских областей, и не должны попадать
+// в их LOG_ALLOCATIONS. Тривиальный thread_local безопасен в operator new
+inline unsigned& InternalAllocationDepth() {
+    thread_local unsigned depth = 0;
+    return depth;
+}
+
+class InternalAllocations {
+public:
+    InternalAllocations() {
+        ++InternalAllocationDepth();
+    }
+
+    ~InternalAllocations() {
+        --InternalAllocationDepth();
+    }
+
+    InternalAllocations(const InternalAllocations&) = delete;
+    InternalAllocations& operator=(const InternalAllocations&) = delete;
+};
+
+// Счётчики пишет только поток-владелец, а Report читает их из другого потока,
+// поэтому они атомарные, но обновляются без read-modify-write
+inline void Bump(std::atomic<uint64_t>& counter, uint64_t delta) {
+    counter.store(counter.load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+struct SiteSlot {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> min{UINT64_MAX};
+    std::atomic<uint64_t> max{0};
+    std::array<std::atomic<uint64_t>, LatencyHistogram::BUCKET_COUNT> histogram{};
+    std::atomic<uint64_t> counted{0};
+    std::array<std::atomic<uint64_t>, COUNTER_COUNT> counters{};
+
+    std::atomic<uint64_t> allocation_scopes{0};
+    std::atomic<uint64_t> allocations{0};
+    std::atomic<uint64_t> frees{0};
+    std::atomic<uint64_t> allocated_bytes{0};
+
+    void RecordAllocations(uint64_t allocation_count, uint64_t free_count, uint64_t bytes) {
+        Bump(allocation_scopes, 1);
+        Bump(allocations, allocation_count);
+        Bump(frees, free_count);
+        Bump(allocated_bytes, bytes);
+    }
+
+    void RecordCounters(const CounterValues& delta) {
+        Bump(counted, 1);
+        for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+            Bump(counters[i], delta[i]);
+        }
+    }
+
+    void Record(uint64_t ns) {
+        Bump(count, 1);
+        Bump(total, ns);
+        if (ns < min.load(std::memory_order_relaxed)) {
+            min.store(ns, std::memory_order_relaxed);
+        }
+        if (ns > max.load(std::memory_order_relaxed)) {
+            max.store(ns, std::memory_order_relaxed);
+        }
+        Bump(histogram[LatencyHistogram::BucketIndex(ns)], 1);
+    }
+
+    void MergeInto(SiteStats& stats) const {
+        const uint64_t n = count.load(std::memory_order_relaxed);
+        if (n == 0) {
+            return;
+        }
+        stats.min = stats.count == 0 ? min.load(std::memory_order_relaxed)
+                                     : std::min(stats.min, min.load(std::memory_order_relaxed));
+        stats.max = std::max(stats.max, max.load(std::memory_order_relaxed));
+        stats.count += n;
+        stats.total += total.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < histogram.size(); ++i) {
+            stats.histogram[i] += histogram[i].load(std::memory_order_relaxed);
+        }
+        stats.allocation_scopes += allocation_scopes.load(std::memory_order_relaxed);
+        stats.allocations += allocations.load(std::memory_order_relaxed);
+        stats.frees += frees.load(std::memory_order_relaxed);
+        stats.allocated_bytes += allocated_bytes.load(std::memory_order_relaxed);
+        stats.counted += counted.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+            stats.counters[i] += counters[i].load(std::memory_order_relaxed);
+        }
+    }
+};
+
+// Числовой аргумент события трассировки; имя должно жить до экспорта,
+// поэтому ожидается строковый литерал. Значение любого арифметического типа
+// приводится к double, так что {"bytes", n} с целым n не сужение
+struct TraceArg {
+    TraceArg() = default;
+
+    template <typename Number, typename = std::enable_if_t<std::is_arithmetic_v<Number>>>
+    TraceArg(const char* arg_name, Number arg_value)
+        : name(arg_name)
+        , value(static_cast<double>(arg_value)) {
+    }
+
+    const char* name = nullptr;
+    double value = 0.0;
+};
+
+struct TraceEvent {
+    static constexpr size_t MAX_ARGS = 2;
+
+    size_t site_id = 0;
+    int64_t start_ns = 0;
+    int64_t duration_ns = 0;
+    std::array<TraceArg, MAX_ARGS> args{};
+    size_t arg_count = 0;
+};
+
+// Буфер событий одного потока: пишет только владелец, без блокировок.
+// События лежат в связном списке блоков, размер блока публикуется с release,
+// так что экспорт из другого потока видит только полностью записанные события
+class TraceBuffer {
+public:
+    explicit TraceBuffer(uint32_t thread_id)
+        : thread_id_(thread_id) {
+    }
+
+    ~TraceBuffer() {
+        Chunk* chunk = head_.next.load(std::memory_order_relaxed);
+        while (chunk != nullptr) {
+            Chunk* next = chunk->next.load(std::memory_order_relaxed);
+            delete chunk;
+            chunk = next;
+        }
+    }
+
+    void Append(const TraceEvent& event) {
+        size_t size = tail_->size.load(std::memory_order_relaxed);
+        if (size == CHUNK_SIZE) {
+            if (total_ >= PROFILE_MAX_TRACE_EVENTS) {
+                Bump(dropped_, 1);
+                return;
+            }
+            InternalAllocations internal;
+            Chunk* chunk = new Chunk;
+            tail_->next.store(chunk, std::memory_order_release);
+            tail_ = chunk;
+            size = 0;
+        }
+        tail_->events[size] = event;
+        tail_->size.store(size + 1, std::memory_order_release);
+        ++total_;
+    }
+
+    template <typename Func>
+    void ForEach(Func func) const {
+        for (const Chunk* chunk = &head_; chunk != nullptr; chunk = chunk->next.load(std::memory_order_acquire)) {
+            const size_t size = chunk->size.load(std::memory_order_acquire);
+            for (size_t i = 0; i < size; ++i) {
+                func(chunk->events[i]);
+            }
+        }
+    }
+
+    uint32_t ThreadId() const {
+        return thread_id_;
+    }
+
+    uint64_t Dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr size_t CHUNK_SIZE = 1024;
+
+    struct Chunk {
+        std::array<TraceEvent, CHUNK_SIZE> events;
+        std::atomic<size_t> size{0};
+        std::atomic<Chunk*> next{nullptr};
+    };
+
+    const uint32_t thread_id_;
+    Chunk head_;
+    Chunk* tail_ = &head_;
+    size_t total_ = 0;
+    std::atomic<uint64_t> dropped_{0};
+};
+
+// Статистика одного потока: слоты создаются лениво при первом замере места
+class ThreadStats {
+public:
+    ~ThreadStats() {
+        for (auto& slot : slots_) {
+            delete slot.load(std::memory_order_relaxed);
+        }
+    }
+
+    SiteSlot* Slot(size_t site_id) {
+        if (site_id >= slots_.size()) {
+            return nullptr;
+        }
+        SiteSlot* slot = slots_[site_id].load(std::memory_order_relaxed);
+        if (slot == nullptr) {
+            InternalAllocations internal;
+            slot = new SiteSlot;
+            slots_[site_id].store(slot, std::memory_order_release);
+        }
+        return slot;
+    }
+
+    const SiteSlot* PeekSlot(size_t site_id) const {
+        return slots_[site_id].load(std::memory_order_acquire);
+    }
+
+    // Буфер трассировки текущей сессии; после ClearTrace заводится новый
+    TraceBuffer& Trace();
+
+    void SetThreadName(std::string name);
+
+private:
+    std::array<std::atomic<SiteSlot*>, PROFILE_MAX_SITES> slots_{};
+    std::shared_ptr<TraceBuffer> trace_;
+    uint64_t trace_generation_ = 0;
+    // Номер потока и его имя сохраняются между сессиями трассировки
+    uint32_t trace_thread_id_ = 0;
+    std::string thread_name_;
+};
+
+class Registry {
+public:
+    // Реестр намеренно не разрушается: к нему обращаются деструкторы
+    // thread_local и обработчики atexit в произвольном порядке
+    static Registry& Instance() {
+        static Registry* instance = [] {
+            InternalAllocations internal;
+            return new Registry;
+        }();
+        return *instance;
+    }
+
+    size_t Register(std::string name) {
+        InternalAllocations internal;
+        std::lock_guard guard(mutex_);
+        names_.push_back(std::move(name));
+        retired_.emplace_back();
+        return names_.size() - 1;
+    }
+
+    void Attach(const std::shared_ptr<ThreadStats>& stats) {
+        InternalAllocations internal;
+        std::lock_guard guard(mutex_);
+        threads_.push_back(stats);
+    }
+
+    // Вызывается при завершении потока: его статистика сливается в общую
+    void Detach(const std::shared_ptr<ThreadStats>& stats) {
+        std::lock_guard guard(mutex_);
+        for (size_t id = 0; id < names_.size() && id < PROFILE_MAX_SITES; ++id) {
+            if (const SiteSlot* slot = stats->PeekSlot(id)) {
+                slot->MergeInto(retired_[id]);
+            }
+        }
+        threads_.erase(std::remove(threads_.begin(), threads_.end(), stats), threads_.end());
+    }
+
+    // Буферы трассировки переживают свои потоки до экспорта или ClearTraces.
+    // thread_id 0 - выдать потоку новый номер
+    std::shared_ptr<TraceBuffer> NewTraceBuffer(uint32_t thread_id, std::string thread_name) {
+        InternalAllocations internal;
+        std::lock_guard guard(mutex_);
+        if (thread_id == 0) {
+            thread_id = ++next_trace_thread_id_;
+        }
+        auto buffer = std::make_shared<TraceBuffer>(thread_id);
+        traces_.push_back({buffer, std::move(thread_name)});
+        return buffer;
+    }
+
+    uint64_t TraceGeneration() const {
+        return trace_generation_.load(std::memory_order_acquire);
+    }
+
+    // Забывает все буферы: живые потоки заведут новые при следующем событии,
+    // а старые освободятся вместе с последней ссылкой на них
+    void ClearTraces() {
+        InternalAllocations internal;
+        std::lock_guard guard(mutex_);
+        trace_generation_.fetch_add(1, std::memory_order_acq_rel);
+        traces_.clear();
+    }
+
+    // Освобождает буферы завершившихся потоков: на них ссылается только реестр
+    void ReleaseFinishedTraces() {
+        InternalAllocations internal;
+        std::lock_guard guard(mutex_);
+        traces_.erase(std::remove_if(traces_.begin(), traces_.end(),
+                                     [](const ThreadTrace& trace) {
+                                         return trace.buffer.use_count() == 1;
+                                     }),
+                      traces_.end());
+    }
+
+    void SetThreadName(const TraceBuffer& buffer, std::string name) {
+        std::lock_guard guard(mutex_);
+        for (auto& trace : traces_) {
+            if (trace.buffer.get() == &buffer) {
+                trace.thread_name = std::move(name);
+            }
+        }
+    }
+
+    template <typename Func>
+    void ForEachTrace(Func func) const {
+        std::lock_guard guard(mutex_);
+        for (const auto& trace : traces_) {
+            func(*trace.buffer, trace.thread_name, names_);
+        }
+    }
+
+    std::vector<std::string> Names() const {
+        std::lock_guard guard(mutex_);
+        return names_;
+    }
+
+    void SetTracing(bool enabled) {
+        tracing_.store(enabled, std::memory_order_relaxed);
+    }
+
+    bool IsTracing() const {
+        return tracing_.load(std::memory_order_relaxed);
+    }
+
+    std::vector<SiteStats> Collect() const {
+        std::lock_guard guard(mutex_);
+        std::vector<SiteStats> result = retired_;
+        for (size_t id = 0; id < result.size(); ++id) {
+            result[id].name = names_[id];
+            if (id >= PROFILE_MAX_SITES) {
+                continue;
+            }
+            for (const auto& stats : threads_) {
+                if (const SiteSlot* slot = stats->PeekSlot(id)) {
+                    slot->MergeInto(result[id]);
+                }
+            }
+        }
+        return result;
+    }
+
+private:
+    Registry() = default;
+
+    struct ThreadTrace {
+        std::shared_ptr<TraceBuffer> buffer;
+        std::string thread_name;
+    };
+
+    mutable std::mutex mutex_;
+    std::vector<std::string> names_;
+    std::vector<SiteStats> retired_;
+    std::vector<std::shared_ptr<ThreadStats>> threads_;
+    std::vector<ThreadTrace> traces_;
+    uint32_t next_trace_thread_id_ = 0;
+    std::atomic<uint64_t> trace_generation_{0};
+    std::atomic<bool> tracing_{false};
+};
+
+inline TraceBuffer& ThreadStats::Trace() {
+    Registry& registry = Registry::Instance();
+    const uint64_t generation = registry.TraceGeneration();
+    if (!trace_ || trace_generation_ != generation) {
+        InternalAllocations internal;
+        trace_ = registry.NewTraceBuffer(trace_thread_id_, thread_name_);
+        trace_thread_id_ = trace_->ThreadId();
+        trace_generation_ = generation;
+    }
+    return *trace_;
+}
+
+inline void ThreadStats::SetThreadName(std::string name) {
+    thread_name_ = name;
+    Registry::Instance().SetThreadName(Trace(), std::move(name));
+}
+
+class ThreadStatsHolder {
+public:
+    ThreadStatsHolder() {
+        InternalAllocations internal;
+        stats_ = std::make_shared<ThreadStats>();
+        Registry::Instance().Attach(stats_);
+    }
+
+    ~ThreadStatsHolder() {
+        InternalAllocations internal;
+        Registry::Instance().Detach(stats_);
+        stats_.reset();
+    }
+
+    ThreadStats& Get() {
+        return *stats_;
+    }
+
+private:
+    std::shared_ptr<ThreadStats> stats_;
+};
+
+inline ThreadStats& LocalStats() {
+    thread_local ThreadStatsHolder holder;
+    return holder.Get();
+}
+
+// Показания группы счётчиков и время, в течение которого группа была
+// включена и реально считала. Когда счётчиков больше, чем регистров PMU,
+// ядро мультиплексирует группы, и time_running отстаёт от time_enabled
+struct CounterReading {
+    CounterValues values{};
+    uint64_t time_enabled = 0;
+    uint64_t time_running = 0;
+};
+
+// Группа счётчиков perf_event_open текущего потока, читается одним read().
+// Если ядро не даёт открыть счётчики (perf_event_paranoid, нет PMU в
+// виртуальной машине, seccomp), группа остаётся недоступной
+class PerfCounterGroup {
+public:
+    PerfCounterGroup() {
+#ifdef PROFILE_HAS_PERF_EVENTS
+        static constexpr std::array<uint64_t, COUNTER_COUNT> configs = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES,
+        };
+        for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+            perf_event_attr attr{};
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = configs[i];
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED
+                             | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            const int group_fd = i == 0 ? -1 : fds_[0];
+            fds_[i] = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0));
+            if (fds_[i] < 0) {
+                Close();
+                return;
+            }
+        }
+#endif
+    }
+
+    PerfCounterGroup(const PerfCounterGroup&) = delete;
+    PerfCounterGroup& operator=(const PerfCounterGroup&) = delete;
+
+    ~PerfCounterGroup() {
+        Close();
+    }
+
+    bool IsAvailable() const {
+        return fds_[0] >= 0;
+    }
+
+    bool Read(CounterReading& reading) const {
+#ifdef PROFILE_HAS_PERF_EVENTS
+        if (!IsAvailable()) {
+            return false;
+        }
+        // Формат PERF_FORMAT_GROUP с временами: число счётчиков, time_enabled,
+        // time_running, затем значения счётчиков
+        std::array<uint64_t, COUNTER_COUNT + 3> buffer;
+        if (read(fds_[0], buffer.data(), sizeof(buffer)) != static_cast<ssize_t>(sizeof(buffer))) {
+            return false;
+        }
+        reading.time_enabled = buffer[1];
+        reading.time_running = buffer[2];
+        std::copy(buffer.begin() + 3, buffer.end(), reading.values.begin());
+        return true;
+#else
+        (void)reading;
+        return false;
+#endif
+    }
+
+private:
+    void Close() {
+#ifdef PROFILE_HAS_PERF_EVENTS
+        for (int& fd : fds_) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            fd = -1;
+        }
+#endif
+    }
+
+    std::array<int, COUNTER_COUNT> fds_ = {-1, -1, -1, -1};
+};
+
+inline PerfCounterGroup& LocalCounters() {
+    thread_local PerfCounterGroup counters;
+    return counters;
+}
+
+// Счётчики выделений памяти потока, их увеличивают замещённые operator new/delete.
+// Тривиальный thread_local без динамической инициализации безопасен внутри operator new
+struct AllocationCounters {
+    uint64_t allocations = 0;
+    uint64_t frees = 0;
+    uint64_t bytes = 0;
+};
+
+inline AllocationCounters& LocalAllocations() {
+    thread_local AllocationCounters counters;
+    return counters;
+}
+
+inline bool& AllocationHooksFlag() {
+    static bool installed = false;
+    return installed;
+}
+
+inline void* AllocateCounted(std::size_t size) {
+    if (InternalAllocationDepth() == 0) {
+        AllocationCounters& counters = LocalAllocations();
+        ++counters.allocations;
+        counters.bytes += size;
+    }
+    if (size == 0) {
+        size = 1;
+    }
+    while (true) {
+        if (void* ptr = std::malloc(size)) {
+            return ptr;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+inline void* AllocateCounted(std::size_t size, std::align_val_t alignment) {
+    if (InternalAllocationDepth() == 0) {
+        AllocationCounters& counters = LocalAllocations();
+        ++counters.allocations;
+        counters.bytes += size;
+    }
+    const auto align = static_cast<std::size_t>(alignment);
+    // aligned_alloc требует размер, кратный выравниванию
+    const std::size_t rounded = std::max(align, (size + align - 1) / align * align);
+    while (true) {
+        if (void* ptr = std::aligned_alloc(align, rounded)) {
+            return ptr;
+        }
+        std::new_handler handler = std::get_new_handler();
+        if (handler == nullptr) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+}
+
+inline void FreeCounted(void* ptr) noexcept {
+    if (ptr != nullptr) {
+        if (InternalAllocationDepth() == 0) {
+            ++LocalAllocations().frees;
+        }
+        std::free(ptr);
+    }
+}
+
+inline std::string FormatNanoseconds(uint64_t ns) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(2);
+    if (ns < 1000) {
+        out << ns << " ns";
+    } else if (ns < 1000'000) {
+        out << ns / 1e3 << " us";
+    } else if (ns < 1000'000'000) {
+        out << ns / 1e6 << " ms";
+    } else {
+        out << ns / 1e9 << " s";
+    }
+    return out.str();
+}
+
+#ifndef PROFILE_ASYNC_RING_SIZE
+#define PROFILE_ASYNC_RING_SIZE 4096
+#endif
+
+struct AsyncRecord {
+    uint32_t site_id = 0;
+    uint32_t thread_id = 0;
+    int64_t start_ns = 0;
+    int64_t duration_ns = 0;
+};
+
+// Кольцевой буфер с одним писателем (поток-владелец) и одним читателем
+// (фоновый поток). При переполнении запись отбрасывается, писатель не ждёт
+class AsyncRing {
+public:
+    explicit AsyncRing(uint32_t thread_id)
+        : thread_id_(thread_id) {
+    }
+
+    void Push(uint32_t site_id, int64_t start_ns, int64_t duration_ns) {
+        const size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail - head_.load(std::memory_order_acquire) == records_.size()) {
+            Bump(dropped_, 1);
+            return;
+        }
+        records_[tail % records_.size()] = {site_id, thread_id_, start_ns, duration_ns};
+        tail_.store(tail + 1, std::memory_order_release);
+    }
+
+    template <typename Func>
+    void Drain(Func func) {
+        const size_t tail = tail_.load(std::memory_order_acquire);
+        for (size_t head = head_.load(std::memory_order_relaxed); head != tail; ++head) {
+            func(records_[head % records_.size()]);
+        }
+        head_.store(tail, std::memory_order_release);
+    }
+
+    uint64_t Dropped() const {
+        return dropped_.load(std::memory_order_relaxed);
+    }
+
+    void Retire() {
+        retired_.store(true, std::memory_order_release);
+    }
+
+    bool IsRetired() const {
+        return retired_.load(std::memory_order_acquire);
+    }
+
+private:
+    const uint32_t thread_id_;
+    std::array<AsyncRecord, PROFILE_ASYNC_RING_SIZE> records_;
+    // Писатель и читатель обновляют свои индексы на разных кэш-линиях
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+    std::atomic<uint64_t> dropped_{0};
+    std::atomic<bool> retired_{false};
+};
+
+class AsyncLogger {
+public:
+    static AsyncLogger& Instance() {
+        static AsyncLogger* instance = new AsyncLogger;
+        return *instance;
+    }
+
+    bool IsRunning() const {
+        return running_.load(std::memory_order_relaxed);
+    }
+
+    std::shared_ptr<AsyncRing> NewRing() {
+        InternalAllocations internal;
+        std::lock_guard guard(rings_mutex_);
+        auto ring = std::make_shared<AsyncRing>(++next_thread_id_);
+        rings_.push_back(ring);
+        return ring;
+    }
+
+    void Start(std::ostream& out, std::unique_ptr<std::ofstream> file = nullptr) {
+        std::lock_guard guard(control_mutex_);
+        StopLocked();
+        file_ = std::move(file);
+        out_ = &out;
+        stopping_ = false;
+        running_.store(true, std::memory_order_relaxed);
+        flusher_ = std::thread([this] {
+            Run();
+        });
+    }
+
+    void Stop() {
+        std::lock_guard guard(control_mutex_);
+        StopLocked();
+    }
+
+private:
+    AsyncLogger() = default;
+
+    void StopLocked() {
+        if (!flusher_.joinable()) {
+            return;
+        }
+        running_.store(false, std::memory_order_relaxed);
+        {
+            std::lock_guard guard(wake_mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_one();
+        flusher_.join();
+        file_.reset();
+    }
+
+    void Run() {
+        using namespace std::chrono_literals;
+
+        std::vector<std::string> names;
+        std::string text;
+        while (true) {
+            bool stop;
+            {
+                std::unique_lock lock(wake_mutex_);
+                stop = wake_.wait_for(lock, 10ms, [this] {
+                    return stopping_;
+                });
+            }
+            // Последний проход после остановки дописывает всё, что успели положить
+            DrainAll(names, text);
+            if (stop) {
+                break;
+            }
+        }
+        uint64_t dropped = 0;
+        {
+            std::lock_guard guard(rings_mutex_);
+            dropped = retired_dropped_;
+            for (const auto& ring : rings_) {
+                dropped += ring->Dropped();
+            }
+        }
+        if (dropped > reported_dropped_) {
+            *out_ << "profile: " << dropped - reported_dropped_ << " records dropped" << std::endl;
+            reported_dropped_ = dropped;
+        }
+    }
+
+    void DrainAll(std::vector<std::string>& names, std::string& text) {
+        std::vector<std::shared_ptr<AsyncRing>> rings;
+        {
+            std::lock_guard guard(rings_mutex_);
+            rings = rings_;
+        }
+
+        text.clear();
+        for (const auto& ring : rings) {
+            const bool retired = ring->IsRetired();
+            ring->Drain([&](const AsyncRecord& record) {
+                if (record.site_id >= names.size()) {
+                    names = Registry::Instance().Names();
+                }
+                text += '[';
+                text += std::to_string(record.thread_id);
+                text += "] ";
+                text += names[record.site_id];
+                text += ": ";
+                text += FormatNanoseconds(static_cast<uint64_t>(record.duration_ns));
+                text += '\n';
+            });
+            // Буфер завершившегося потока больше не пополняется
+            if (retired) {
+                std::lock_guard guard(rings_mutex_);
+                rings_.erase(std::remove(rings_.begin(), rings_.end(), ring), rings_.end());
+                retired_dropped_ += ring->Dropped();
+            }
+        }
+        if (!text.empty()) {
+            out_->write(text.data(), static_cast<std::streamsize>(text.size()));
+            out_->flush();
+        }
+    }
+
+    std::atomic<bool> running_{false};
+
+    std::mutex control_mutex_;
+    std::thread flusher_;
+    std::ostream* out_ = nullptr;
+    std::unique_ptr<std::ofstream> file_;
+    uint64_t reported_dropped_ = 0;
+
+    std::mutex wake_mutex_;
+    std::condition_variable wake_;
+    bool stopping_ = false;
+
+    std::mutex rings_mutex_;
+    std::vector<std::shared_ptr<AsyncRing>> rings_;
+    uint64_t retired_dropped_ = 0;
+    uint32_t next_thread_id_ = 0;
+};
+
+class AsyncRingHolder {
+public:
+    AsyncRingHolder()
+        : ring_(AsyncLogger::Instance().NewRing()) {
+    }
+
+    ~AsyncRingHolder() {
+        ring_->Retire();
+    }
+
+    AsyncRing& Get() {
+        return *ring_;
+    }
+
+private:
+    std::shared_ptr<AsyncRing> ring_;
+};
+
+inline AsyncRing& LocalRing() {
+    thread_local AsyncRingHolder holder;
+    return holder.Get();
+}
+
+}  // namespace detail
+
+// Место вызова LOG_DURATION_AGGREGATE, регистрируется один раз
+class Site {
+public:
+    explicit Site(std::string name)
+        : id_(detail::Registry::Instance().Register(std::move(name))) {
+    }
+
+    size_t Id() const {
+        return id_;
+    }
+
+private:
+    size_t id_;
+};
+
+inline void Record(const Site& site, uint64_t ns) {
+    if (detail::SiteSlot* slot = detail::LocalStats().Slot(site.Id())) {
+        slot->Record(ns);
+    }
+}
+
+template <typename Clock = DefaultClock>
+class BasicScopeTimer {
+public:
+    explicit BasicScopeTimer(const Site& site)
+        : site_(site) {
+    }
+
+    BasicScopeTimer(const Site& site, std::initializer_list<detail::TraceArg> args)
+        : site_(site) {
+        for (const detail::TraceArg& arg : args) {
+            if (arg_count_ < args_.size()) {
+                args_[arg_count_++] = arg;
+            }
+        }
+    }
+
+    ~BasicScopeTimer() {
+        using namespace std::chrono;
+
+        const auto end_time = Clock::now();
+        const auto ns = duration_cast<nanoseconds>(end_time - start_time_).count();
+        Record(site_, ns);
+
+        if (detail::Registry::Instance().IsTracing()) {
+            detail::TraceEvent event;
+            event.site_id = site_.Id();
+            event.start_ns = duration_cast<nanoseconds>(start_time_.time_since_epoch()).count();
+            event.duration_ns = ns;
+            event.args = args_;
+            event.arg_count = arg_count_;
+            detail::LocalStats().Trace().Append(event);
+        }
+    }
+
+private:
+    const Site& site_;
+    std::array<detail::TraceArg, detail::TraceEvent::MAX_ARGS> args_{};
+    size_t arg_count_ = 0;
+    const typename Clock::time_point start_time_ = Clock::now();
+};
+
+using ScopeTimer = BasicScopeTimer<>;
+
+// Область видимости LOG_PERF_COUNTERS: к замеру времени добавляет разность
+// аппаратных счётчиков потока между входом и выходом
+class CounterScope {
+public:
+    explicit CounterScope(const Site& site)
+        : counters_(site)
+        , timer_(site) {
+    }
+
+private:
+    // Объявлены раньше timer_: счётчики читаются до запуска таймера и после
+    // его остановки, так что системные вызовы read() не входят в замер времени
+    class Counters {
+    public:
+        explicit Counters(const Site& site)
+            : site_(site) {
+            has_start_ = detail::LocalCounters().Read(start_);
+        }
+
+        ~Counters() {
+            detail::CounterReading end;
+            if (!has_start_ || !detail::LocalCounters().Read(end)) {
+                return;
+            }
+            const uint64_t enabled = end.time_enabled - start_.time_enabled;
+            const uint64_t running = end.time_running - start_.time_running;
+            // Группа ни разу не попала на PMU - оценить нечего
+            if (running == 0) {
+                return;
+            }
+            // При мультиплексировании значения экстраполируются на всё время
+            // области, как это делает perf stat
+            const double scale = running < enabled ? static_cast<double>(enabled) / running : 1.0;
+            CounterValues delta;
+            for (size_t i = 0; i < COUNTER_COUNT; ++i) {
+                delta[i] = end.values[i] - start_.values[i];
+                if (scale != 1.0) {
+                    delta[i] = static_cast<uint64_t>(static_cast<double>(delta[i]) * scale);
+                }
+            }
+            if (detail::SiteSlot* slot = detail::LocalStats().Slot(site_.Id())) {
+                slot->RecordCounters(delta);
+            }
+        }
+
+    private:
+        const Site& site_;
+        detail::CounterReading start_;
+        bool has_start_ = false;
+    };
+
+    Counters counters_;
+    ScopeTimer timer_;
+};
+
+// Область видимости LOG_ALLOCATIONS: к замеру времени добавляет число
+// выделений, освобождений и выделенных байт в текущем потоке
+class AllocationScope {
+public:
+    explicit AllocationScope(const Site& site)
+        : timer_(site)
+        , site_(site)
+        , start_(detail::LocalAllocations()) {
+    }
+
+    ~AllocationScope() {
+        if (!detail::AllocationHooksFlag()) {
+            return;
+        }
+        const detail::AllocationCounters end = detail::LocalAllocations();
+        if (detail::SiteSlot* slot = detail::LocalStats().Slot(site_.Id())) {
+            slot->RecordAllocations(end.allocations - start_.allocations, end.frees - start_.frees,
+                                    end.bytes - start_.bytes);
+        }
+    }
+
+private:
+    ScopeTimer timer_;
+    const Site& site_;
+    const detail::AllocationCounters start_;
+};
+
+// Область видимости LOG_DURATION_ASYNC: пока фоновый вывод не запущен,
+// замер ничего не записывает
+template <typename Clock = DefaultClock>
+class BasicAsyncScope {
+public:
+    explicit BasicAsyncScope(const Site& site)
+        : site_(site) {
+    }
+
+    ~BasicAsyncScope() {
+        using namespace std::chrono;
+
+        if (!detail::AsyncLogger::Instance().IsRunning()) {
+            return;
+        }
+        const auto end_time = Clock::now();
+        detail::LocalRing().Push(static_cast<uint32_t>(site_.Id()),
+                                 duration_cast<nanoseconds>(start_time_.time_since_epoch()).count(),
+                                 duration_cast<nanoseconds>(end_time - start_time_).count());
+    }
+
+private:
+    const Site& site_;
+    const typename Clock::time_point start_time_ = Clock::now();
+};
+
+using AsyncScope = BasicAsyncScope<>;
+
+// Запускает фоновый поток, который раз в 10 мс выбирает записи
+// LOG_DURATION_ASYNC из буферов всех потоков и пишет их в поток вывода
+inline void StartAsyncSink(std::ostream& out = std::cerr) {
+    detail::AsyncLogger::Instance().Start(out);
+}
+
+inline bool StartAsyncSink(const std::string& path) {
+    auto file = std::make_unique<std::ofstream>(path);
+    if (!*file) {
+        return false;
+    }
+    std::ostream& out = *file;
+    detail::AsyncLogger::Instance().Start(out, std::move(file));
+    return true;
+}
+
+// Останавливает фоновый поток, дописав накопленные записи
+// и число отброшенных при переполнении
+inline void StopAsyncSink() {
+    detail::AsyncLogger::Instance().Stop();
+}
+
+// Подключены ли замещённые operator new/delete
+inline bool AllocationHooksInstalled() {
+    return detail::AllocationHooksFlag();
+}
+
+// Удалось ли открыть аппаратные счётчики в текущем потоке
+inline bool PerfCountersAvailable() {
+    return detail::LocalCounters().IsAvailable();
+}
+
+// Сливает статистику всех потоков, включая уже завершившиеся
+inline std::vector<SiteStats> Collect() {
+    return detail::Registry::Instance().Collect();
+}
+
+inline void Report(std::ostream& out = std::cerr) {
+    using detail::FormatNanoseconds;
+
+    for (const SiteStats& stats : Collect()) {
+        if (stats.count == 0) {
+            continue;
+        }
+        out << stats.name << ": count=" << stats.count
+            << " total=" << FormatNanoseconds(stats.total)
+            << " mean=" << FormatNanoseconds(stats.total / stats.count)
+            << " min=" << FormatNanoseconds(stats.min)
+            << " max=" << FormatNanoseconds(stats.max)
+            << " p50=" << FormatNanoseconds(stats.Percentile(0.5))
+            << " p99=" << FormatNanoseconds(stats.Percentile(0.99))
+            << " p999=" << FormatNanoseconds(stats.Percentile(0.999));
+        if (stats.allocation_scopes > 0) {
+            const double calls = static_cast<double>(stats.allocation_scopes);
+            out << std::fixed << std::setprecision(2)
+                << " allocs/call=" << stats.allocations / calls
+                << " frees/call=" << stats.frees / calls
+                << " bytes/call=" << stats.allocated_bytes / calls
+                << std::defaultfloat;
+        }
+        if (stats.counted > 0) {
+            out << std::fixed << std::setprecision(2)
+                << " ipc=" << stats.InstructionsPerCycle()
+                << " cycles/call=" << stats.CounterPerCall(Counter::CYCLES)
+                << " cache-misses/call=" << stats.CounterPerCall(Counter::CACHE_MISSES)
+                << " branch-misses/call=" << stats.CounterPerCall(Counter::BRANCH_MISSES)
+                << std::defaultfloat;
+        }
+        out << '\n';
+    }
+    out.flush();
+}
+
+// Печатает сводку при нормальном завершении программы
+inline void ReportAtExit(std::ostream& out = std::cerr) {
+    static std::ostream* report_stream = nullptr;
+    if (report_stream == nullptr) {
+        std::atexit([] {
+            Report(*report_stream);
+        });
+    }
+    report_stream = &out;
+}
+
+// Отбрасывает собранные события всех потоков. Поток, который больше не
+// пишет событий, держит свой прежний буфер до завершения
+inline void ClearTrace() {
+    detail::Registry::Instance().ClearTraces();
+}
+
+// Трассировка: пока она включена, каждая агрегирующая область видимости
+// дополнительно пишет событие с началом и длительностью в буфер своего потока.
+// Каждый вызов начинает новую сессию: события прошлых сессий отбрасываются
+inline void StartTracing() {
+    ClearTrace();
+    detail::Registry::Instance().SetTracing(true);
+}
+
+inline void StopTracing() {
+    detail::Registry::Instance().SetTracing(false);
+}
+
+// Имя текущего потока на временной шкале
+inline void SetThreadName(std::string name) {
+    detail::LocalStats().SetThreadName(std::move(name));
+}
+
+// Собирает события всех потоков в формате Chrome Trace Event
+// (chrome://tracing, ui.perfetto.dev). Области видимости выгружаются
+// как полные события "X", вложенность восстанавливается по времени.
+// Буферы завершившихся потоков после выгрузки освобождаются, так что
+// повторный вызов их событий уже не содержит
+inline json::Document BuildChromeTrace() {
+    using namespace std::literals;
+
+    int64_t origin = INT64_MAX;
+    detail::Registry::Instance().ForEachTrace([&origin](const detail::TraceBuffer& buffer, const std::string&,
+                                                        const std::vector<std::string>&) {
+        buffer.ForEach([&origin](const detail::TraceEvent& event) {
+            origin = std::min(origin, event.start_ns);
+        });
+    });
+
+    json::Array events;
+    detail::Registry::Instance().ForEachTrace([&](const detail::TraceBuffer& buffer, const std::string& thread_name,
+                                                  const std::vector<std::string>& site_names) {
+        const int tid = static_cast<int>(buffer.ThreadId());
+        if (!thread_name.empty()) {
+            events.push_back(json::Dict{
+                {"name"s, "thread_name"s},
+                {"ph"s, "M"s},
+                {"pid"s, 1},
+                {"tid"s, tid},
+                {"args"s, json::Dict{{"name"s, thread_name}}},
+            });
+        }
+        buffer.ForEach([&](const detail::TraceEvent& event) {
+            json::Dict entry{
+                {"name"s, site_names[event.site_id]},
+                {"cat"s, "profile"s},
+                {"ph"s, "X"s},
+                {"ts"s, static_cast<double>(event.start_ns - origin) / 1e3},
+                {"dur"s, static_cast<double>(event.duration_ns) / 1e3},
+                {"pid"s, 1},
+                {"tid"s, tid},
+            };
+            if (event.arg_count > 0) {
+                json::Dict args;
+                for (size_t i = 0; i < event.arg_count; ++i) {
+                    args.emplace(event.args[i].name, event.args[i].value);
+                }
+                entry.emplace("args"s, std::move(args));
+            }
+            events.push_back(std::move(entry));
+        });
+    });
+
+    detail::Registry::Instance().ReleaseFinishedTraces();
+
+    return json::Document{json::Dict{
+        {"traceEvents"s, std::move(events)},
+        {"displayTimeUnit"s, "ns"s},
+    }};
+}
+
+inline void WriteChromeTrace(std::ostream& out) {
+    json::Print(BuildChromeTrace(), out);
+}
+
+// Сэмплирующий профилировщик: SIGPROF по таймеру процессорного времени
+// снимает стек прерванного потока в заранее выделенный буфер, а имена
+// функций восстанавливаются уже после остановки через dladdr. Функции
+// с внутренним связыванием видны только при сборке с -rdynamic
+namespace sampling {
+
+#ifndef PROFILE_SAMPLING_MAX_DEPTH
+#define PROFILE_SAMPLING_MAX_DEPTH 48
+#endif
+
+namespace detail {
+
+struct Sample {
+    int depth = 0;
+    std::array<void*, PROFILE_SAMPLING_MAX_DEPTH> frames;
+};
+
+struct SamplerState {
+    explicit SamplerState(size_t capacity)
+        : samples(capacity) {
+    }
+
+    std::vector<Sample> samples;
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> completed{0};
+};
+
+inline std::atomic<SamplerState*>& State() {
+    static std::atomic<SamplerState*> state{nullptr};
+    return state;
+}
+
+// Идёт ли сэмплирование: буфер State() остаётся и после Stop
+inline std::atomic<bool>& Running() {
+    static std::atomic<bool> running{false};
+    return running;
+}
+
+// Число обработчиков сигнала, выполняющихся сейчас в других потоках.
+// Остановка таймера их не дожидается, поэтому буфер освобождается только
+// после того, как счётчик обнулится
+inline std::atomic<int>& HandlersInFlight() {
+    static std::atomic<int> in_flight{0};
+    return in_flight;
+}
+
+// Заменяет буфер; прежний освобождается, когда до него уже не дотянется ни
+// один обработчик. Обработчик увеличивает счётчик до чтения State(), так что
+// после обмена и нулевого счётчика старый указатель никем не прочитан
+inline void ReplaceState(SamplerState* state) {
+    SamplerState* old = State().exchange(state);
+    if (old == nullptr) {
+        return;
+    }
+    while (HandlersInFlight().load() != 0) {
+        std::this_thread::yield();
+    }
+    delete old;
+}
+
+#ifdef PROFILE_HAS_SAMPLING
+// Действие SIGPROF до Start, возвращается в Stop
+inline struct sigaction& PreviousAction() {
+    static struct sigaction previous {};
+    return previous;
+}
+
+// Обработчик сигнала: только атомарные операции и backtrace, который
+// безопасен после первого вызова, загрузившего libgcc
+inline void OnSignal(int) {
+    const int saved_errno = errno;
+    HandlersInFlight().fetch_add(1);
+    if (SamplerState* state = State().load()) {
+        const size_t index = state->next.fetch_add(1, std::memory_order_relaxed);
+        if (index < state->samples.size()) {
+            Sample& sample = state->samples[index];
+            sample.depth = backtrace(sample.frames.data(), static_cast<int>(sample.frames.size()));
+            state->completed.fetch_add(1, std::memory_order_release);
+        }
+    }
+    HandlersInFlight().fetch_sub(1, std::memory_order_release);
+    errno = saved_errno;
+}
+
+// Возвращает действие SIGPROF, бывшее до Start. Действие по умолчанию
+// завершает процесс, поэтому вместо него ставится SIG_IGN: запоздавший
+// сигнал после остановки таймера не должен убить программу
+inline void RestoreAction() {
+    const struct sigaction& previous = PreviousAction();
+    if (!(previous.sa_flags & SA_SIGINFO) && previous.sa_handler == SIG_DFL) {
+        signal(SIGPROF, SIG_IGN);
+    } else {
+        sigaction(SIGPROF, &previous, nullptr);
+    }
+}
+
+inline std::string Symbolize(void* address) {
+    using namespace std::literals;
+
+    Dl_info info;
+    if (dladdr(address, &info) != 0 && info.dli_sname != nullptr) {
+        int status = 0;
+        char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+        std::string name = status == 0 && demangled != nullptr ? demangled : info.dli_sname;
+        std::free(demangled);
+        return name;
+    }
+    // Без символа кадры группируются по модулю, чтобы не дробить отчёт по адресам
+    if (dladdr(address, &info) != 0 && info.dli_fname != nullptr) {
+        const char* module = std::strrchr(info.dli_fname, '/');
+        return "["s + (module != nullptr ? module + 1 : info.dli_fname) + "]"s;
+    }
+    std::ostringstream out;
+    out << address;
+    return out.str();
+}
+#endif
+
+// Стеки с именами функций, от корня к листу
+inline std::vector<std::vector<std::string>> SymbolizedStacks() {
+    std::vector<std::vector<std::string>> stacks;
+#ifdef PROFILE_HAS_SAMPLING
+    SamplerState* state = State().load(std::memory_order_acquire);
+    if (state == nullptr) {
+        return stacks;
+    }
+    // Первые два кадра - сам обработчик и трамплин возврата из сигнала
+    constexpr int SKIP_FRAMES = 2;
+    std::unordered_map<void*, std::string> cache;
+    const size_t count = std::min(state->completed.load(std::memory_order_acquire), state->samples.size());
+    for (size_t i = 0; i < count; ++i) {
+        const Sample& sample = state->samples[i];
+        std::vector<std::string> stack;
+        for (int frame = sample.depth - 1; frame >= SKIP_FRAMES; --frame) {
+            // Для кадров выше листа это адрес возврата; сдвиг на байт назад
+            // попадает в инструкцию вызова, а не в следующую функцию
+            char* address = static_cast<char*>(sample.frames[frame]);
+            if (frame != SKIP_FRAMES) {
+                --address;
+            }
+            auto it = cache.find(address);
+            if (it == cache.end()) {
+                it = cache.emplace(address, Symbolize(address)).first;
+            }
+            stack.push_back(it->second);
+        }
+        if (!stack.empty()) {
+            stacks.push_back(std::move(stack));
+        }
+    }
+#endif
+    return stacks;
+}
+
+}  // namespace detail
+
+// Запускает сэмплирование с заданной частотой (по процессорному времени
+// процесса) в новый буфер на max_samples стеков; стеки прошлого запуска
+// отбрасываются. false, если платформа не поддерживается, параметры неверны,
+// таймер не удалось запустить или сэмплирование уже идёт
+inline bool Start(int frequency_hz = 1000, size_t max_samples = 10000) {
+#ifdef PROFILE_HAS_SAMPLING
+    if (frequency_hz <= 0 || detail::Running().exchange(true)) {
+        return false;
+    }
+    // Первый вызов backtrace загружает libgcc и выделяет память,
+    // поэтому делаем его здесь, а не в обработчике сигнала
+    void* warmup[1];
+    backtrace(warmup, 1);
+
+    detail::ReplaceState(new detail::SamplerState(max_samples));
+
+    struct sigaction action {};
+    action.sa_handler = detail::OnSignal;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, &detail::PreviousAction());
+
+    // tv_usec должен быть меньше секунды, иначе setitimer вернёт EINVAL
+    const long interval_us = std::max(1L, 1'000'000L / frequency_hz);
+    itimerval timer{};
+    timer.it_interval.tv_sec = interval_us / 1'000'000;
+    timer.it_interval.tv_usec = interval_us % 1'000'000;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+        detail::RestoreAction();
+        detail::ReplaceState(nullptr);
+        detail::Running().store(false);
+        return false;
+    }
+    return true;
+#else
+    (void)frequency_hz;
+    (void)max_samples;
+    return false;
+#endif
+}
+
+// Останавливает таймер. Собранные стеки остаются доступны для отчётов
+// до следующего Start или Reset
+inline void Stop() {
+#ifdef PROFILE_HAS_SAMPLING
+    if (!detail::Running().load()) {
+        return;
+    }
+    itimerval timer{};
+    setitimer(ITIMER_PROF, &timer, nullptr);
+    detail::RestoreAction();
+    detail::Running().store(false);
+#endif
+}
+
+// Останавливает сэмплирование и освобождает буфер стеков
+inline void Reset() {
+    Stop();
+    detail::ReplaceState(nullptr);
+}
+
+// Число снятых и не поместившихся в буфер стеков
+inline size_t SampleCount() {
+    const detail::SamplerState* state = detail::State().load(std::memory_order_acquire);
+    return state == nullptr ? 0 : std::min(state->next.load(), state->samples.size());
+}
+
+inline size_t DroppedSamples() {
+    const detail::SamplerState* state = detail::State().load(std::memory_order_acquire);
+    return state == nullptr ? 0 : state->next.load() - SampleCount();
+}
+
+// Плоский профиль: top_n функций по собственному времени (функция на вершине
+// стека) с долей полного времени (функция где-либо в стеке)
+inline void WriteFlatProfile(std::ostream& out, size_t top_n = 20) {
+    const auto stacks = detail::SymbolizedStacks();
+    std::unordered_map<std::string, std::pair<size_t, size_t>> counts;
+    for (const auto& stack : stacks) {
+        ++counts[stack.back()].first;
+        for (auto it = stack.begin(); it != stack.end(); ++it) {
+            // Рекурсивная функция входит в полное время один раз
+            if (std::find(stack.begin(), it, *it) == it) {
+                ++counts[*it].second;
+            }
+        }
+    }
+
+    std::vector<std::pair<std::string, std::pair<size_t, size_t>>> rows(counts.begin(), counts.end());
+    std::sort(rows.begin(), rows.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.second != rhs.second ? lhs.second > rhs.second : lhs.first < rhs.first;
+    });
+    if (rows.size() > top_n) {
+        rows.resize(top_n);
+    }
+
+    const double total = std::max<size_t>(stacks.size(), 1);
+    out << "samples: " << stacks.size() << ", dropped: " << DroppedSamples() << '\n';
+    out << std::setw(8) << "self%" << std::setw(8) << "total%" << "  function\n";
+    out << std::fixed << std::setprecision(2);
+    for (const auto& [function, count] : rows) {
+        out << std::setw(8) << 100.0 * count.first / total << std::setw(8) << 100.0 * count.second / total
+            << "  " << function << '\n';
+    }
+    out << std::defaultfloat;
+}
+
+// Свёрнутые стеки для flamegraph.pl и speedscope: "main;f;g 42"
+inline void WriteCollapsedStacks(std::ostream& out) {
+    std::map<std::string, size_t> collapsed;
+    for (const auto& stack : detail::SymbolizedStacks()) {
+        std::string line;
+        for (const std::string& function : stack) {
+            if (!line.empty()) {
+                line += ';';
+            }
+            line += function;
+        }
+        ++collapsed[line];
+    }
+    for (const auto& [line, count] : collapsed) {
+        out << line << ' ' << count << '\n';
+    }
+}
+
+}  // namespace sampling
+
+}  // namespace profile
+
+// Замещение глобальных operator new/delete. Стандарт требует ровно одного
+// определения на программу, поэтому хуки включаются макросом в одном .cpp:
+//     #define PROFILE_DEFINE_ALLOCATION_HOOKS
+//     #include "profile.hpp"
+#ifdef PROFILE_DEFINE_ALLOCATION_HOOKS
+
+namespace profile::detail {
+static const bool allocation_hooks_installed = (AllocationHooksFlag() = true);
+}  // namespace profile::detail
+
+void* operator new(std::size_t size) {
+    return profile::detail::AllocateCounted(size);
+}
+
+void* operator new[](std::size_t size) {
+    return profile::detail::AllocateCounted(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return profile::detail::AllocateCounted(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return profile::detail::AllocateCounted(size);
+    } catch (...) {
+        return nullptr;
+    }
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return profile::detail::AllocateCounted(size, alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return profile::detail::AllocateCounted(size, alignment);
+}
+
+void operator delete(void* ptr) noexcept {
+    profile::detail::FreeCounted(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    profile::detail::FreeCounted(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+    profile::detail::FreeCounted(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+    profile::detail::FreeCounted(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    profile::detail::FreeCounted(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    profile::detail::FreeCounted(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    profile::detail::FreeCounted(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    profile::detail::FreeCounted(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+    profile::detail::FreeCounted(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+    profile::detail::FreeCounted(ptr);
+}
+
+#endif  // PROFILE_DEFINE_ALLOCATION_HOOKS
@@ -1,14 +1,177 @@
 #include "svg.hpp"
 
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <queue>
+#include <stdexcept>
+#include <thread>
+
 namespace svg {
  
 using namespace std::literals;
+
+namespace {
+
+const RenderOptions DEFAULT_OPTIONS;
+
+void RenderHeader(OutputBuffer& out, const StyleTable* styles, const Rect* view_box = nullptr,
+                  std::optional<double> size = std::nullopt) {
+    out << "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>\n"sv;
+    out << "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\""sv;
+    if (view_box != nullptr) {
+        out << " viewBox=\""sv << view_box->min_x << ' ' << view_box->min_y << ' '
+            << view_box->Width() << ' ' << view_box->Height() << '"';
+    }
+    if (size) {
+        out << " width=\""sv << *size << "\" height=\""sv << *size << '"';
+    }
+    out << ">\n"sv;
+    if (styles != nullptr && styles->Size() > 0) {
+        styles->RenderCss(out);
+    }
+}
+
+void RenderFooter(OutputBuffer& out) {
+    out << "</svg>"sv;
+}
+
+// Совпадают ли параметры, от которых зависит текст объектов
+bool SameFragmentOptions(const RenderOptions& lhs, const RenderOptions& rhs) {
+    return lhs.precision == rhs.precision && lhs.style_classes == rhs.style_classes
+        && lhs.simplification == rhs.simplification && lhs.simplify_tolerance == rhs.simplify_tolerance
+        && lhs.coordinate_decimals == rhs.coordinate_decimals && lhs.polyline_as_path == rhs.polyline_as_path;
+}
+
+RenderContext MakeContext(OutputBuffer& out, const RenderOptions& options, const StyleTable& styles) {
+    return RenderContext(out, options.style_classes ? &styles : nullptr, &options);
+}
+
+// Меньше объектов в блоке не окупают передачу между потоками
+constexpr size_t MIN_OBJECTS_PER_CHUNK = 4096;
+// Размер блока, которым однопоточный вывод передаётся приёмнику
+constexpr size_t SINK_BLOCK_BYTES = 256 * 1024;
+
+using RangeRenderer = std::function<void(const RenderContext& context, size_t begin, size_t end)>;
+
+// Выводит count объектов: при одном потоке в один буфер, иначе блоками на
+// пуле потоков. Блоки разбираются по возрастанию номера, а вызывающий поток
+// пишет готовые блоки в поток вывода строго по порядку, не дожидаясь остальных
+void RenderObjects(OutputSink& out, const RenderOptions& options, const StyleTable& styles, const Rect* view_box,
+                   size_t count, const RangeRenderer& render) {
+    const StyleTable* used_styles = options.style_classes ? &styles : nullptr;
+    size_t threads = options.threads != 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min(threads, (count + MIN_OBJECTS_PER_CHUNK - 1) / MIN_OBJECTS_PER_CHUNK);
+
+    OutputBuffer buffer(options.precision);
+    RenderHeader(buffer, used_styles, view_box);
+    if (threads <= 1) {
+        // Готовый текст уходит блоками, чтобы приёмник (например, сжатие)
+        // начинал работу, не дожидаясь конца документа
+        const RenderContext context = MakeContext(buffer, options, styles);
+        for (size_t begin = 0; begin < count; begin += MIN_OBJECTS_PER_CHUNK) {
+            render(context, begin, std::min(count, begin + MIN_OBJECTS_PER_CHUNK));
+            if (buffer.Size() >= SINK_BLOCK_BYTES) {
+                out.Write(buffer.View());
+                buffer.Clear();
+            }
+        }
+        RenderFooter(buffer);
+        out.Write(buffer.View());
+        return;
+    }
+    out.Write(buffer.View());
+
+    // Несколько блоков на поток сглаживают разную стоимость объектов
+    const size_t chunk_count = std::min(threads * 4, (count + MIN_OBJECTS_PER_CHUNK - 1) / MIN_OBJECTS_PER_CHUNK);
+    const size_t chunk_size = (count + chunk_count - 1) / chunk_count;
+
+    std::vector<OutputBuffer> chunks(chunk_count, OutputBuffer(options.precision));
+    std::vector<bool> done(chunk_count, false);
+    std::atomic<size_t> next_chunk{0};
+    // Ошибка в рабочем потоке или в out.Write: новые блоки больше не берутся
+    std::atomic<bool> cancelled{false};
+    std::mutex mutex;
+    std::condition_variable chunk_done;
+    std::exception_ptr error;
+
+    auto worker = [&] {
+        for (size_t chunk = next_chunk++; chunk < chunk_count && !cancelled; chunk = next_chunk++) {
+            try {
+                const size_t begin = chunk * chunk_size;
+                render(MakeContext(chunks[chunk], options, styles), begin, std::min(count, begin + chunk_size));
+            } catch (...) {
+                std::lock_guard guard(mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                cancelled = true;
+            }
+            {
+                std::lock_guard guard(mutex);
+                done[chunk] = true;
+            }
+            chunk_done.notify_one();
+        }
+    };
+
+    // Потоки присоединяются и при исключении из out.Write или из создания
+    // потока, иначе деструктор std::thread вызвал бы std::terminate
+    struct PoolJoiner {
+        std::vector<std::thread>& pool;
+        std::atomic<bool>& cancelled;
+
+        ~PoolJoiner() {
+            cancelled = true;
+            for (auto& thread : pool) {
+                thread.join();
+            }
+        }
+    };
+
+    {
+        std::vector<std::thread> pool;
+        pool.reserve(threads);
+        PoolJoiner joiner{pool, cancelled};
+        for (size_t i = 0; i < threads; ++i) {
+            pool.emplace_back(worker);
+        }
+
+        for (size_t chunk = 0; chunk < chunk_count; ++chunk) {
+            {
+                std::unique_lock lock(mutex);
+                chunk_done.wait(lock, [&] {
+                    return done[chunk] || error;
+                });
+                if (error) {
+                    break;
+                }
+            }
+            out.Write(chunks[chunk].View());
+            chunks[chunk] = OutputBuffer();
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    buffer.Clear();
+    RenderFooter(buffer);
+    out.Write(buffer.View());
+}
+
+}  // namespace
     
 void ColorPrinter::operator() (std::monostate) {
         out << "none"sv;
     }
     
-void ColorPrinter::operator() (std::string color) {
+void ColorPrinter::operator() (const std::string& color) {
     out << color;
 }
     
@@ -25,6 +188,193 @@ Rgb::Rgb(uint8_t red_, uint8_t green_, uint8_t blue_) :
     
 Rgba::Rgba(uint8_t red_, uint8_t green_,uint8_t blue_, double opacity_) :
                         red(red_), green(green_), blue(blue_), opacity(opacity_) {}
+
+bool operator==(const Rgb& lhs, const Rgb& rhs) {
+    return lhs.red == rhs.red && lhs.green == rhs.green && lhs.blue == rhs.blue;
+}
+
+bool operator!=(const Rgb& lhs, const Rgb& rhs) {
+    return !(lhs == rhs);
+}
+
+bool operator==(const Rgba& lhs, const Rgba& rhs) {
+    return lhs.red == rhs.red && lhs.green == rhs.green && lhs.blue == rhs.blue && lhs.opacity == rhs.opacity;
+}
+
+bool operator!=(const Rgba& lhs, const Rgba& rhs) {
+    return !(lhs == rhs);
+}
+
+// ---------- PathStyle ------------------
+
+bool PathStyle::operator==(const PathStyle& other) const {
+    return fill_color == other.fill_color && stroke_color == other.stroke_color
+        && stroke_width == other.stroke_width && stroke_line_cap == other.stroke_line_cap
+        && stroke_line_join == other.stroke_line_join;
+}
+
+namespace {
+
+void HashCombine(size_t& seed, size_t value) {
+    seed ^= value + 0x9e3779b97f4a7c15ULL + (seed << 6) + (seed >> 2);
+}
+
+size_t HashColor(const std::optional<Color>& color) {
+    if (!color) {
+        return 0;
+    }
+    size_t seed = color->index() + 1;
+    if (const auto* name = std::get_if<std::string>(&*color)) {
+        HashCombine(seed, std::hash<std::string>{}(*name));
+    } else if (const auto* rgb = std::get_if<Rgb>(&*color)) {
+        HashCombine(seed, rgb->red << 16 | rgb->green << 8 | rgb->blue);
+    } else if (const auto* rgba = std::get_if<Rgba>(&*color)) {
+        HashCombine(seed, rgba->red << 16 | rgba->green << 8 | rgba->blue);
+        HashCombine(seed, std::hash<double>{}(rgba->opacity));
+    }
+    return seed;
+}
+
+template <typename T>
+size_t HashOptional(const std::optional<T>& value) {
+    return value ? std::hash<T>{}(*value) + 1 : 0;
+}
+
+}  // namespace
+
+size_t PathStyleHasher::operator()(const PathStyle& style) const {
+    size_t seed = HashColor(style.fill_color);
+    HashCombine(seed, HashColor(style.stroke_color));
+    HashCombine(seed, HashOptional(style.stroke_width));
+    HashCombine(seed, HashOptional(style.stroke_line_cap));
+    HashCombine(seed, HashOptional(style.stroke_line_join));
+    return seed;
+}
+
+void RenderStyleAttributes(OutputBuffer& out, const PathStyle& style) {
+    if (style.fill_color) {
+        out << " fill=\""sv;
+        std::visit(ColorPrinter{out}, *style.fill_color);
+        out << "\""sv;
+    }
+    if (style.stroke_color) {
+        out << " stroke=\""sv;
+        std::visit(ColorPrinter{out}, *style.stroke_color);
+        out << "\""sv;
+    }
+    if (style.stroke_width) {
+        out << " stroke-width=\""sv << *style.stroke_width << "\""sv;
+    }
+    if (style.stroke_line_cap) {
+        out << " stroke-linecap=\""sv << *style.stroke_line_cap << "\""sv;
+    }
+    if (style.stroke_line_join) {
+        out << " stroke-linejoin=\""sv << *style.stroke_line_join << "\""sv;
+    }
+}
+
+// ---------- StyleTable ------------------
+
+size_t StyleTable::NextId() {
+    if (free_ids_.empty()) {
+        styles_.emplace_back();
+        return styles_.size() - 1;
+    }
+    const size_t id = free_ids_.back();
+    free_ids_.pop_back();
+    return id;
+}
+
+std::shared_ptr<PathStyle> StyleTable::Intern(std::shared_ptr<PathStyle> style) {
+    if (const auto it = ids_.find(*style); it != ids_.end()) {
+        return styles_[it->second];
+    }
+    const size_t id = NextId();
+    ids_.emplace(*style, id);
+    ids_by_address_.emplace(style.get(), id);
+    styles_[id] = style;
+    return style;
+}
+
+void StyleTable::Merge(const StyleTable& other) {
+    for (const auto& style : other.styles_) {
+        if (!style) {
+            continue;
+        }
+        if (const auto it = ids_.find(*style); it != ids_.end()) {
+            ids_by_address_.emplace(style.get(), it->second);
+            aliases_.push_back(style);
+            continue;
+        }
+        const size_t id = NextId();
+        ids_.emplace(*style, id);
+        ids_by_address_.emplace(style.get(), id);
+        styles_[id] = style;
+    }
+}
+
+size_t StyleTable::ReleaseUnused() {
+    size_t released = 0;
+    for (size_t id = 0; id < styles_.size(); ++id) {
+        auto& style = styles_[id];
+        // Единственный владелец - сама таблица
+        if (!style || style.use_count() != 1) {
+            continue;
+        }
+        ids_.erase(*style);
+        ids_by_address_.erase(style.get());
+        style.reset();
+        free_ids_.push_back(id);
+        ++released;
+    }
+    return released;
+}
+
+std::optional<size_t> StyleTable::Find(const PathStyle* style) const {
+    const auto it = ids_by_address_.find(style);
+    if (it == ids_by_address_.end()) {
+        return std::nullopt;
+    }
+    return it->second;
+}
+
+void StyleTable::RenderCss(OutputBuffer& out) const {
+    out << "<style>\n"sv;
+    for (size_t id = 0; id < styles_.size(); ++id) {
+        if (!styles_[id]) {
+            continue;
+        }
+        const PathStyle& style = *styles_[id];
+        out << ".s"sv << id << '{';
+        char separator = ' ';
+        auto property = [&out, &separator](std::string_view name) -> OutputBuffer& {
+            if (separator == ';') {
+                out << ';';
+            }
+            separator = ';';
+            return out << name << ':';
+        };
+        if (style.fill_color) {
+            property("fill"sv);
+            std::visit(ColorPrinter{out}, *style.fill_color);
+        }
+        if (style.stroke_color) {
+            property("stroke"sv);
+            std::visit(ColorPrinter{out}, *style.stroke_color);
+        }
+        if (style.stroke_width) {
+            property("stroke-width"sv) << *style.stroke_width;
+        }
+        if (style.stroke_line_cap) {
+            property("stroke-linecap"sv) << *style.stroke_line_cap;
+        }
+        if (style.stroke_line_join) {
+            property("stroke-linejoin"sv) << *style.stroke_line_join;
+        }
+        out << "}\n"sv;
+    }
+    out << "</style>\n"sv;
+}
     
 std::ostream& StrokeLineCapOutput(std::ostream& out, svg::StrokeLineCap cap) {
     if(cap == svg::StrokeLineCap::BUTT) {
@@ -75,6 +425,64 @@ std::ostream& operator<<(std::ostream& os, svg::StrokeLineJoin join) {
     StrokeLineJoinOutput(os, join);
     return os;
 }
+
+OutputBuffer& OutputBuffer::operator<<(double value) {
+    char buffer[32];
+    auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::general, precision_);
+    data_.append(buffer, end);
+    return *this;
+}
+
+void OutputBuffer::AppendFixed(double value, int decimals) {
+    char buffer[64];
+    auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), value, std::chars_format::fixed, decimals);
+    if (ec != std::errc()) {
+        *this << value;
+        return;
+    }
+    if (decimals > 0) {
+        while (end[-1] == '0') {
+            --end;
+        }
+        if (end[-1] == '.') {
+            --end;
+        }
+    }
+    // -0.0001 при округлении до целых даёт "-0"
+    if (end - buffer == 2 && buffer[0] == '-' && buffer[1] == '0') {
+        data_.push_back('0');
+        return;
+    }
+    data_.append(buffer, end);
+}
+
+OutputBuffer& operator<<(OutputBuffer& out, svg::StrokeLineCap cap) {
+    switch (cap) {
+        case svg::StrokeLineCap::BUTT:
+            return out << "butt"sv;
+        case svg::StrokeLineCap::ROUND:
+            return out << "round"sv;
+        case svg::StrokeLineCap::SQUARE:
+            return out << "square"sv;
+    }
+    return out;
+}
+
+OutputBuffer& operator<<(OutputBuffer& out, svg::StrokeLineJoin join) {
+    switch (join) {
+        case svg::StrokeLineJoin::ARCS:
+            return out << "arcs"sv;
+        case svg::StrokeLineJoin::BEVEL:
+            return out << "bevel"sv;
+        case svg::StrokeLineJoin::MITER:
+            return out << "miter"sv;
+        case svg::StrokeLineJoin::MITER_CLIP:
+            return out << "miter-clip"sv;
+        case svg::StrokeLineJoin::ROUND:
+            return out << "round"sv;
+    }
+    return out;
+}
     
 void Object::Render(const RenderContext& context) const {
     context.RenderIndent();
@@ -82,83 +490,308 @@ void Object::Render(const RenderContext& context) const {
     // Делегируем вывод тега своим подклассам
     RenderObject(context);
 
-    context.out << std::endl;
+    context.out << '\n';
 }
  
+namespace {
+
+// Квадрат расстояния от точки p до отрезка ab
+double SquaredSegmentDistance(Point p, Point a, Point b) {
+    const double dx = b.x - a.x;
+    const double dy = b.y - a.y;
+    double t = 0.0;
+    if (dx != 0.0 || dy != 0.0) {
+        t = std::clamp(((p.x - a.x) * dx + (p.y - a.y) * dy) / (dx * dx + dy * dy), 0.0, 1.0);
+    }
+    const double ex = p.x - (a.x + t * dx);
+    const double ey = p.y - (a.y + t * dy);
+    return ex * ex + ey * ey;
+}
+
+double TriangleArea(Point a, Point b, Point c) {
+    return std::abs((b.x - a.x) * (c.y - a.y) - (c.x - a.x) * (b.y - a.y)) / 2.0;
+}
+
+// Отмечает в keep точки, которые остаются после упрощения Дугласа-Пекера
+void SimplifyDouglasPeucker(const Point* points, size_t count, double tolerance, std::vector<bool>& keep) {
+    keep.assign(count, false);
+    keep.front() = keep.back() = true;
+    const double squared_tolerance = tolerance * tolerance;
+    std::vector<std::pair<size_t, size_t>> segments{{0, count - 1}};
+    while (!segments.empty()) {
+        const auto [first, last] = segments.back();
+        segments.pop_back();
+        double max_distance = 0.0;
+        size_t farthest = first;
+        for (size_t i = first + 1; i < last; ++i) {
+            const double distance = SquaredSegmentDistance(points[i], points[first], points[last]);
+            if (distance > max_distance) {
+                max_distance = distance;
+                farthest = i;
+            }
+        }
+        if (max_distance > squared_tolerance) {
+            keep[farthest] = true;
+            segments.push_back({first, farthest});
+            segments.push_back({farthest, last});
+        }
+    }
+}
+
+// Visvalingam-Whyatt: точка с наименьшей площадью треугольника с соседями
+// удаляется, пока эта площадь меньше порога. Площади соседей пересчитываются,
+// устаревшие записи в очереди пропускаются
+void SimplifyVisvalingamWhyatt(const Point* points, size_t count, double min_area, std::vector<bool>& keep) {
+    keep.assign(count, true);
+    std::vector<size_t> prev(count);
+    std::vector<size_t> next(count);
+    std::vector<double> area(count, 0.0);
+    using Entry = std::pair<double, size_t>;
+    std::priority_queue<Entry, std::vector<Entry>, std::greater<Entry>> queue;
+    for (size_t i = 1; i + 1 < count; ++i) {
+        prev[i] = i - 1;
+        next[i] = i + 1;
+        area[i] = TriangleArea(points[i - 1], points[i], points[i + 1]);
+        queue.push({area[i], i});
+    }
+    while (!queue.empty()) {
+        const auto [current_area, i] = queue.top();
+        queue.pop();
+        if (!keep[i] || current_area != area[i]) {
+            continue;
+        }
+        if (current_area >= min_area) {
+            break;
+        }
+        keep[i] = false;
+        next[prev[i]] = next[i];
+        prev[next[i]] = prev[i];
+        for (const size_t neighbour : {prev[i], next[i]}) {
+            if (neighbour > 0 && neighbour + 1 < count) {
+                // Площадь не уменьшается, иначе точку удалили бы раньше соседки
+                area[neighbour] = std::max(current_area,
+                                           TriangleArea(points[prev[neighbour]], points[neighbour], points[next[neighbour]]));
+                queue.push({area[neighbour], neighbour});
+            }
+        }
+    }
+}
+
+// Точки ломаной после упрощения и округления; без преобразований - исходные
+struct PreparedPoints {
+    const Point* begin;
+    const Point* end;
+};
+
+PreparedPoints PreparePoints(const RenderOptions& options, const Point* begin, const Point* end,
+                             std::vector<Point>& scratch) {
+    const size_t count = static_cast<size_t>(end - begin);
+    const bool simplify = options.simplification != PolylineSimplification::NONE
+        && options.simplify_tolerance > 0.0 && count > 2;
+    if (!simplify && !options.coordinate_decimals) {
+        return {begin, end};
+    }
+
+    scratch.clear();
+    if (simplify) {
+        thread_local std::vector<bool> keep;
+        if (options.simplification == PolylineSimplification::DOUGLAS_PEUCKER) {
+            SimplifyDouglasPeucker(begin, count, options.simplify_tolerance, keep);
+        } else {
+            SimplifyVisvalingamWhyatt(begin, count, options.simplify_tolerance * options.simplify_tolerance, keep);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            if (keep[i]) {
+                scratch.push_back(begin[i]);
+            }
+        }
+    } else {
+        scratch.assign(begin, end);
+    }
+
+    if (options.coordinate_decimals) {
+        const double scale = std::pow(10.0, *options.coordinate_decimals);
+        size_t size = 0;
+        for (Point point : scratch) {
+            point = {std::round(point.x * scale) / scale, std::round(point.y * scale) / scale};
+            if (size == 0 || point.x != scratch[size - 1].x || point.y != scratch[size - 1].y) {
+                scratch[size++] = point;
+            }
+        }
+        scratch.resize(size);
+    }
+    return {scratch.data(), scratch.data() + scratch.size()};
+}
+
+void AppendCoordinate(OutputBuffer& out, const RenderOptions& options, double value) {
+    if (options.coordinate_decimals) {
+        out.AppendFixed(value, *options.coordinate_decimals);
+    } else {
+        out << value;
+    }
+}
+
+// Пишет координату и возвращает значение, которое прочитает парсер SVG.
+// Разбор записанного нужен только для относительных смещений <path>
+double WriteCoordinate(OutputBuffer& out, const RenderOptions& options, double value) {
+    const size_t start = out.Size();
+    AppendCoordinate(out, options, value);
+    const std::string_view written = out.View().substr(start);
+    double parsed = value;
+    std::from_chars(written.data(), written.data() + written.size(), parsed);
+    return parsed;
+}
+
+}  // namespace
+
 // ---------- Circle ------------------
  
 Circle& Circle::SetCenter(Point center)  {
+    Invalidate();
     center_ = center;
     return *this;
 }
  
 Circle& Circle::SetRadius(double radius)  {
+    Invalidate();
     radius_ = radius;
     return *this;
 }
  
+std::optional<Rect> Circle::BoundingBox() const {
+    const double extent = radius_ + StrokeOutset();
+    return Rect{center_.x - extent, center_.y - extent, center_.x + extent, center_.y + extent};
+}
+
 void Circle::RenderObject(const RenderContext& context) const {
     auto& out = context.out;
     out << "<circle cx=\""sv << center_.x << "\" cy=\""sv << center_.y << "\" "sv;
     out << "r=\""sv << radius_ << "\""sv;
-    RenderAttrs(out);
+    RenderAttrs(context);
     out << "/>"sv;
 }
     
     Polyline& Polyline::AddPoint(Point point) {
+        Invalidate();
         points_.push_back(point);
         return *this;
     }
     
+    std::optional<Rect> Polyline::BoundingBox() const {
+        if (points_.empty()) {
+            return std::nullopt;
+        }
+        Rect box{points_.front().x, points_.front().y, points_.front().x, points_.front().y};
+        for (const Point& point : points_) {
+            box.min_x = std::min(box.min_x, point.x);
+            box.min_y = std::min(box.min_y, point.y);
+            box.max_x = std::max(box.max_x, point.x);
+            box.max_y = std::max(box.max_y, point.y);
+        }
+        const double extent = StrokeOutset() * 4.0;
+        return Rect{box.min_x - extent, box.min_y - extent, box.max_x + extent, box.max_y + extent};
+    }
+
     void Polyline::RenderObject(const RenderContext& context) const {
+        RenderPoints(context, points_.data(), points_.data() + points_.size());
+    }
+    
+    void Polyline::RenderPoints(const RenderContext& context, const Point* begin, const Point* end) const {
         auto& out = context.out;
-        out<<"<polyline points=\""sv;
-        for(size_t i = 0; i < points_.size(); ++i) {
-            out<<points_[i].x<<","sv<<points_[i].y;
-            if(i != points_.size() - 1) {
-                out<<" "sv;
+        if (context.options == nullptr) {
+            RenderPoints(RenderContext(out, context.indent_step, context.indent, context.styles, &DEFAULT_OPTIONS),
+                         begin, end);
+            return;
+        }
+        const RenderOptions& options = *context.options;
+        thread_local std::vector<Point> scratch;
+        const auto [first, last] = PreparePoints(options, begin, end, scratch);
+
+        if (options.polyline_as_path) {
+            // Смещения считаются от позиции, которую восстановит парсер,
+            // поэтому ошибки округления не накапливаются вдоль пути
+            out<<"<path d=\""sv;
+            Point position;
+            for(const Point* point = first; point != last; ++point) {
+                if(point == first) {
+                    out<<"M"sv;
+                    position.x = WriteCoordinate(out, options, point->x);
+                    out<<","sv;
+                    position.y = WriteCoordinate(out, options, point->y);
+                    continue;
+                }
+                out<<(point == first + 1 ? "l"sv : " "sv);
+                position.x += WriteCoordinate(out, options, point->x - position.x);
+                out<<","sv;
+                position.y += WriteCoordinate(out, options, point->y - position.y);
+            }
+        } else {
+            out<<"<polyline points=\""sv;
+            for(const Point* point = first; point != last; ++point) {
+                if(point != first) {
+                    out<<" "sv;
+                }
+                AppendCoordinate(out, options, point->x);
+                out<<","sv;
+                AppendCoordinate(out, options, point->y);
             }
         }
         out<<"\"";
-        RenderAttrs(out);
+        RenderAttrs(context);
         out<<"/>"sv;
     }
     
     Text& Text::SetPosition(Point pos) {
+        Invalidate();
         position_ = pos;
         return *this;
     }
  
     Text& Text::SetOffset(Point offset) {
+        Invalidate();
         offset_ = offset;
         return *this;
     }
  
     Text& Text::SetFontSize(uint32_t size) {
+        Invalidate();
         font_size_ = size;
         return *this;
     }
  
     Text& Text::SetFontFamily(std::string font_family) {
-        font_family_ = font_family;
+        Invalidate();
+        font_family_ = std::move(font_family);
         return *this;
     }
  
     // Задаёт толщину шрифта (атрибут font-weight)
     Text& Text::SetFontWeight(std::string font_weight) {
-        font_weight_ = font_weight;
+        Invalidate();
+        font_weight_ = std::move(font_weight);
         return *this;
     }
  
     Text& Text::SetData(std::string data) {
-        data_ = data;
+        Invalidate();
+        data_ = std::move(data);
         return *this;
     }
     
+    std::optional<Rect> Text::BoundingBox() const {
+        const double size = font_size_;
+        const double extent = StrokeOutset();
+        const double x = position_.x + offset_.x;
+        const double baseline = position_.y + offset_.y;
+        // Над базовой линией не выше кегля, под ней - выносные элементы
+        return Rect{x - extent, baseline - size - extent, x + size * static_cast<double>(data_.size()) + extent,
+                    baseline + size / 2.0 + extent};
+    }
+
     void Text::RenderObject(const RenderContext& context) const {
         auto& out = context.out;
         out<<"<text";
-        RenderAttrs(out);
+        RenderAttrs(context);
         out << " x=\""<<position_.x<<"\" y=\""<<position_.y<<"\" dx=\""<<offset_.x<<"\" dy=\""<<offset_.y<<"\" font-size=\""<<font_size_<<"\"";
         if(!font_family_.empty()) {
             out<<" font-family=\""<<font_family_<<"\"";
@@ -169,22 +802,569 @@ void Circle::RenderObject(const RenderContext& context) const {
         out << ">"<<data_<<"</text>";
     }
     
+    void ObjectContainer::AddObject(Circle&& circle) {
+        AddPtr(std::make_unique<Circle>(std::move(circle)));
+    }
+    
+    void ObjectContainer::AddObject(Polyline&& polyline) {
+        AddPtr(std::make_unique<Polyline>(std::move(polyline)));
+    }
+    
+    void ObjectContainer::AddObject(Text&& text) {
+        AddPtr(std::make_unique<Text>(std::move(text)));
+    }
+    
     void Document::AddPtr(std::unique_ptr<Object>&& obj) {
+        obj->InternStyle(styles_);
         objects_.push_back(std::move(obj));
     }
+
+    Document::Document(double index_cell_size)
+        : index_cell_size_(index_cell_size) {
+        if (!(index_cell_size > 0.0)) {
+            throw std::invalid_argument("Document: index cell size must be positive");
+        }
+    }
+
+    const GridIndex& Document::Index() const {
+        // Добавление объектов не бывает одновременным с выводом, поэтому
+        // после выхода из-под блокировки индекс не меняется
+        std::lock_guard guard(*index_mutex_);
+        if (!index_) {
+            index_.emplace(index_cell_size_);
+        }
+        for (size_t id = index_->Size(); id < objects_.size(); ++id) {
+            index_->Insert(objects_[id]->BoundingBox());
+        }
+        return *index_;
+    }
  
-    void Document::Render(std::ostream& out) const {
-        
-        out << "<?xml version=\"1.0\" encoding=\"UTF-8\" ?>"sv << std::endl;
-        out << "<svg xmlns=\"http://www.w3.org/2000/svg\" version=\"1.1\">"sv << std::endl;
+    void Document::Render(std::ostream& out, const RenderOptions& options) const {
+        OstreamSink sink(out);
+        RenderObjects(sink, options, styles_, nullptr, objects_.size(),
+                      [this](const RenderContext& context, size_t begin, size_t end) {
+            RenderRange(context, begin, end);
+        });
+    }
+
+    void Document::Render(OutputSink& out, const RenderOptions& options) const {
+        RenderObjects(out, options, styles_, nullptr, objects_.size(),
+                      [this](const RenderContext& context, size_t begin, size_t end) {
+            RenderRange(context, begin, end);
+        });
+        out.Finish();
+    }
  
-        for(const auto& object : objects_) {
-            object->Render(out);
+    void Document::Render(OutputBuffer& out, const RenderOptions& options) const {
+        const StyleTable* styles = options.style_classes ? &styles_ : nullptr;
+        RenderHeader(out, styles);
+        RenderRange(MakeContext(out, options, styles_), 0, objects_.size());
+        RenderFooter(out);
+    }
+    
+    void Document::RenderRange(const RenderContext& context, size_t begin, size_t end) const {
+        for(size_t i = begin; i < end; ++i) {
+            objects_[i]->Render(context);
+        }
+    }
+
+    void Document::Render(std::ostream& out, const Rect& viewport, const RenderOptions& options) const {
+        std::vector<uint32_t> ids;
+        Index().Query(viewport, ids);
+        OstreamSink sink(out);
+        RenderObjects(sink, options, styles_, &viewport, ids.size(),
+                      [this, &ids](const RenderContext& context, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                objects_[ids[i]]->Render(context);
+            }
+        });
+    }
+
+    void Document::Render(OutputBuffer& out, const Rect& viewport, const RenderOptions& options) const {
+        std::vector<uint32_t> ids;
+        Index().Query(viewport, ids);
+        RenderHeader(out, options.style_classes ? &styles_ : nullptr, &viewport);
+        const RenderContext context = MakeContext(out, options, styles_);
+        for (const uint32_t id : ids) {
+            objects_[id]->Render(context);
+        }
+        RenderFooter(out);
+    }
+
+    void Document::RenderTiles(const TilePyramid& pyramid, const TileSink& sink, const RenderOptions& options) const {
+        if (pyramid.min_zoom < 0 || pyramid.min_zoom > pyramid.max_zoom || pyramid.max_zoom > 30) {
+            throw std::invalid_argument("RenderTiles: zoom levels must satisfy 0 <= min_zoom <= max_zoom <= 30");
+        }
+
+        // Фрагменты объектов сериализуются при первом попадании в тайл
+        constexpr size_t NOT_RENDERED = std::numeric_limits<size_t>::max();
+        OutputBuffer fragments(options.precision);
+        const RenderContext fragment_context = MakeContext(fragments, options, styles_);
+        std::vector<std::pair<size_t, size_t>> fragment_bounds(objects_.size(), {NOT_RENDERED, 0});
+        auto fragment = [&](uint32_t id) {
+            auto& [begin, end] = fragment_bounds[id];
+            if (begin == NOT_RENDERED) {
+                begin = fragments.Size();
+                objects_[id]->Render(fragment_context);
+                end = fragments.Size();
+            }
+            return fragments.View().substr(begin, end - begin);
+        };
+
+        const GridIndex& index = Index();
+        const StyleTable* used_styles = options.style_classes ? &styles_ : nullptr;
+        OutputBuffer tile(options.precision);
+        // Кандидаты каждого уровня; уровень z + 1 фильтрует список уровня z
+        std::vector<std::vector<uint32_t>> candidates(pyramid.max_zoom + 2);
+        index.Query(pyramid.bounds, candidates[0]);
+
+        auto visit = [&](auto& self, const TileId& id) -> void {
+            const double tiles = std::ldexp(1.0, id.zoom);
+            const double width = pyramid.bounds.Width() / tiles;
+            const double height = pyramid.bounds.Height() / tiles;
+            const Rect area{pyramid.bounds.min_x + width * id.x, pyramid.bounds.min_y + height * id.y,
+                            pyramid.bounds.min_x + width * (id.x + 1), pyramid.bounds.min_y + height * (id.y + 1)};
+
+            const auto& parent = candidates[id.zoom];
+            auto& inside = candidates[id.zoom + 1];
+            inside.clear();
+            for (const uint32_t object : parent) {
+                if (index.Intersects(object, area)) {
+                    inside.push_back(object);
+                }
+            }
+            // В пустом тайле пусты и все его потомки
+            if (inside.empty()) {
+                return;
+            }
+
+            if (id.zoom >= pyramid.min_zoom) {
+                tile.Clear();
+                RenderHeader(tile, used_styles, &area, pyramid.tile_size);
+                for (const uint32_t object : inside) {
+                    tile << fragment(object);
+                }
+                RenderFooter(tile);
+                sink(id, tile.View());
+            }
+            if (id.zoom == pyramid.max_zoom) {
+                return;
+            }
+            for (int dy = 0; dy < 2; ++dy) {
+                for (int dx = 0; dx < 2; ++dx) {
+                    self(self, TileId{id.zoom + 1, id.x * 2 + dx, id.y * 2 + dy});
+                }
+            }
+        };
+        visit(visit, TileId{});
+    }
+    
+    // ---------- GridIndex ------------------
+
+    GridIndex::GridIndex(double cell_size)
+        : cell_size_(cell_size) {
+        if (!(cell_size > 0.0)) {
+            throw std::invalid_argument("GridIndex: cell size must be positive");
+        }
+    }
+
+    std::optional<GridIndex::CellRange> GridIndex::Cells(const Rect& area) const {
+        // Ячейки нумеруются 32-битными числами; что за пределами - вне сетки
+        constexpr double LIMIT = std::numeric_limits<int32_t>::max();
+        const double min_x = std::floor(area.min_x / cell_size_);
+        const double min_y = std::floor(area.min_y / cell_size_);
+        const double max_x = std::floor(area.max_x / cell_size_);
+        const double max_y = std::floor(area.max_y / cell_size_);
+        if (!(min_x >= -LIMIT && min_y >= -LIMIT && max_x <= LIMIT && max_y <= LIMIT && min_x <= max_x && min_y <= max_y)) {
+            return std::nullopt;
+        }
+        return CellRange{static_cast<int64_t>(min_x), static_cast<int64_t>(min_y),
+                         static_cast<int64_t>(max_x), static_cast<int64_t>(max_y)};
+    }
+
+    void GridIndex::Insert(const std::optional<Rect>& box) {
+        const auto id = static_cast<uint32_t>(boxes_.size());
+        boxes_.push_back(box);
+        const auto cells = box ? Cells(*box) : std::nullopt;
+        if (!cells || cells->Count() > MAX_CELLS_PER_OBJECT) {
+            unindexed_.push_back(id);
+            return;
+        }
+        for (int64_t y = cells->min_y; y <= cells->max_y; ++y) {
+            for (int64_t x = cells->min_x; x <= cells->max_x; ++x) {
+                cells_[CellKey(x, y)].push_back(id);
+            }
+        }
+    }
+
+    void GridIndex::Query(const Rect& area, std::vector<uint32_t>& result) const {
+        const size_t first = result.size();
+        auto add_cell = [&](const std::vector<uint32_t>& ids) {
+            for (const uint32_t id : ids) {
+                if (boxes_[id]->Intersects(area)) {
+                    result.push_back(id);
+                }
+            }
+        };
+
+        const auto cells = Cells(area);
+        if (cells && static_cast<size_t>(cells->Count()) <= cells_.size()) {
+            for (int64_t y = cells->min_y; y <= cells->max_y; ++y) {
+                for (int64_t x = cells->min_x; x <= cells->max_x; ++x) {
+                    if (const auto it = cells_.find(CellKey(x, y)); it != cells_.end()) {
+                        add_cell(it->second);
+                    }
+                }
+            }
+        } else {
+            // Область больше заполненной части сетки: дешевле пройти по всем ячейкам
+            for (const auto& [key, ids] : cells_) {
+                add_cell(ids);
+            }
+        }
+        for (const uint32_t id : unindexed_) {
+            if (Intersects(id, area)) {
+                result.push_back(id);
+            }
+        }
+
+        // Объект из нескольких ячеек найден несколько раз
+        std::sort(result.begin() + first, result.end());
+        result.erase(std::unique(result.begin() + first, result.end()), result.end());
+    }
+
+    // ---------- PooledDocument ------------------
+    
+    void PooledDocument::AddToOrder(Kind kind, size_t index) {
+        if (index > INDEX_MASK) {
+            throw std::length_error("PooledDocument: too many objects of one type");
+        }
+        order_.push_back(static_cast<uint32_t>(kind) << KIND_SHIFT | static_cast<uint32_t>(index));
+    }
+    
+    void PooledDocument::AddPtr(std::unique_ptr<Object>&& obj) {
+        obj->InternStyle(styles_);
+        AddToOrder(Kind::OTHER, others_.size());
+        others_.push_back(std::move(obj));
+    }
+    
+    void PooledDocument::AddObject(Circle&& circle) {
+        AddToOrder(Kind::CIRCLE, circles_.size());
+        circle.InternStyle(styles_);
+        circles_.push_back(std::move(circle));
+    }
+    
+    void PooledDocument::AddObject(Polyline&& polyline) {
+        AddToOrder(Kind::POLYLINE, polylines_.size());
+        polyline.InternStyle(styles_);
+        polyline_points_.push_back({static_cast<uint32_t>(points_.size()),
+                                    static_cast<uint32_t>(polyline.points_.size())});
+        points_.insert(points_.end(), polyline.points_.begin(), polyline.points_.end());
+        // Сам объект хранит только стиль, его точки уже в общем буфере
+        polyline.points_ = {};
+        polylines_.push_back(std::move(polyline));
+    }
+    
+    void PooledDocument::AddObject(Text&& text) {
+        AddToOrder(Kind::TEXT, texts_.size());
+        text.InternStyle(styles_);
+        texts_.push_back(std::move(text));
+    }
+    
+    void PooledDocument::Reserve(size_t circles, size_t polylines, size_t texts, size_t points) {
+        circles_.reserve(circles);
+        polylines_.reserve(polylines);
+        polyline_points_.reserve(polylines);
+        texts_.reserve(texts);
+        points_.reserve(points);
+        order_.reserve(circles + polylines + texts);
+    }
+    
+    void PooledDocument::Render(std::ostream& out, const RenderOptions& options) const {
+        OstreamSink sink(out);
+        RenderObjects(sink, options, styles_, nullptr, order_.size(),
+                      [this](const RenderContext& context, size_t begin, size_t end) {
+            RenderRange(context, begin, end);
+        });
+    }
+
+    void PooledDocument::Render(OutputSink& out, const RenderOptions& options) const {
+        RenderObjects(out, options, styles_, nullptr, order_.size(),
+                      [this](const RenderContext& context, size_t begin, size_t end) {
+            RenderRange(context, begin, end);
+        });
+        out.Finish();
+    }
+    
+    void PooledDocument::Render(OutputBuffer& out, const RenderOptions& options) const {
+        const StyleTable* styles = options.style_classes ? &styles_ : nullptr;
+        RenderHeader(out, styles);
+        RenderRange(MakeContext(out, options, styles_), 0, order_.size());
+        RenderFooter(out);
+    }
+    
+    void PooledDocument::RenderRange(const RenderContext& context, size_t begin, size_t end) const {
+        auto& out = context.out;
+        for (size_t i = begin; i < end; ++i) {
+            const uint32_t entry = order_[i];
+            const size_t index = entry & INDEX_MASK;
+            // Вызовы через конкретные final-классы компилятор разрешает статически
+            switch (static_cast<Kind>(entry >> KIND_SHIFT)) {
+                case Kind::CIRCLE:
+                    context.RenderIndent();
+                    circles_[index].RenderObject(context);
+                    break;
+                case Kind::POLYLINE: {
+                    const PointRange range = polyline_points_[index];
+                    const Point* first = points_.data() + range.offset;
+                    context.RenderIndent();
+                    polylines_[index].RenderPoints(context, first, first + range.count);
+                    break;
+                }
+                case Kind::TEXT:
+                    context.RenderIndent();
+                    texts_[index].RenderObject(context);
+                    break;
+                case Kind::OTHER:
+                    others_[index]->Render(context);
+                    continue;
+            }
+            out << '\n';
         }
- 
-        out << "</svg>"sv;
-        
-        
     }
  
+    // ---------- RetainedDocument ------------------
+
+    void RetainedDocument::AddPtr(std::unique_ptr<Object>&& obj) {
+        obj->InternStyle(styles_);
+        entries_.emplace(next_id_++, Entry{std::move(obj), {}, std::nullopt});
+    }
+
+    RetainedDocument::Entry& RetainedDocument::FindEntry(Id id) {
+        const auto it = entries_.find(id);
+        if (it == entries_.end()) {
+            throw std::out_of_range("RetainedDocument: unknown object id");
+        }
+        return it->second;
+    }
+
+    void RetainedDocument::Replace(Id id, std::unique_ptr<Object>&& obj) {
+        Entry& entry = FindEntry(id);
+        obj->InternStyle(styles_);
+        entry.object = std::move(obj);
+        entry.rendered_revision.reset();
+    }
+
+    bool RetainedDocument::Remove(Id id) {
+        return entries_.erase(id) > 0;
+    }
+
+    size_t RetainedDocument::RefreshFragments(const RenderOptions& options) {
+        if (!cached_options_ || !SameFragmentOptions(*cached_options_, options)) {
+            cached_options_ = options;
+            scratch_ = OutputBuffer(options.precision);
+            for (auto& [id, entry] : entries_) {
+                entry.rendered_revision.reset();
+            }
+        }
+
+        // Стили удалённых и изменённых объектов больше никому не нужны. Чистые
+        // фрагменты ссылаются только на стили своих объектов, так что номера
+        // в них остаются верными
+        styles_.ReleaseUnused();
+
+        const RenderContext context = MakeContext(scratch_, options, styles_);
+        size_t total = 0;
+        for (auto& [id, entry] : entries_) {
+            const uint64_t revision = entry.object->Revision();
+            if (entry.rendered_revision != revision) {
+                // Изменённый стиль стал собственной копией объекта
+                entry.object->InternStyle(styles_);
+                scratch_.Clear();
+                entry.object->Render(context);
+                entry.fragment.assign(scratch_.View());
+                entry.rendered_revision = revision;
+            }
+            total += entry.fragment.size();
+        }
+        return total;
+    }
+
+    void RetainedDocument::Render(std::ostream& out, const RenderOptions& options) {
+        OutputBuffer buffer(options.precision);
+        Render(buffer, options);
+        buffer.WriteTo(out);
+    }
+
+    void RetainedDocument::Render(OutputBuffer& out, const RenderOptions& options) {
+        RenderOptions effective = options;
+        effective.precision = out.Precision();
+        const size_t total = RefreshFragments(effective);
+
+        RenderHeader(out, effective.style_classes ? &styles_ : nullptr);
+        out.Reserve(out.Size() + total + 16);
+        for (const auto& [id, entry] : entries_) {
+            out << std::string_view(entry.fragment);
+        }
+        RenderFooter(out);
+    }
+
+    // ---------- StreamWriter ------------------
+
+    StreamWriter::StreamWriter(std::ostream& out, const RenderOptions& options)
+        : own_sink_(std::make_unique<OstreamSink>(out))
+        , sink_(*own_sink_)
+        , options_(options)
+        , buffer_(options.precision) {
+        Start();
+    }
+
+    StreamWriter::StreamWriter(OutputSink& sink, const RenderOptions& options)
+        : sink_(sink)
+        , options_(options)
+        , buffer_(options.precision) {
+        Start();
+    }
+
+    void StreamWriter::Start() {
+        options_.style_classes = false;
+        buffer_.Reserve(FLUSH_THRESHOLD * 2);
+        RenderHeader(buffer_, nullptr);
+    }
+
+    StreamWriter::~StreamWriter() {
+        if (std::uncaught_exceptions() > uncaught_exceptions_) {
+            return;
+        }
+        try {
+            Close();
+        } catch (...) {
+        }
+    }
+
+    void StreamWriter::AddPtr(std::unique_ptr<Object>&& obj) {
+        Write(*obj);
+    }
+
+    void StreamWriter::AddObject(Circle&& circle) {
+        Write(circle);
+    }
+
+    void StreamWriter::AddObject(Polyline&& polyline) {
+        Write(polyline);
+    }
+
+    void StreamWriter::AddObject(Text&& text) {
+        Write(text);
+    }
+
+    void StreamWriter::Write(const Object& obj) {
+        if (closed_) {
+            throw std::logic_error("StreamWriter: object added after Close");
+        }
+        obj.Render(RenderContext(buffer_, nullptr, &options_));
+        if (buffer_.Size() >= FLUSH_THRESHOLD) {
+            Flush();
+        }
+    }
+
+    void StreamWriter::Flush() {
+        sink_.Write(buffer_.View());
+        flushed_ += buffer_.Size();
+        buffer_.Clear();
+    }
+
+    void StreamWriter::Close() {
+        if (closed_) {
+            return;
+        }
+        closed_ = true;
+        RenderFooter(buffer_);
+        Flush();
+        sink_.Finish();
+    }
+
+    // ---------- ConcurrentDocument ------------------
+
+    void ConcurrentDocument::Producer::AddPtr(std::unique_ptr<Object>&& obj) {
+        obj->InternStyle(styles_);
+        items_.push_back({layer_, std::move(obj)});
+    }
+
+    ConcurrentDocument::Producer& ConcurrentDocument::MakeProducer(uint32_t key) {
+        std::lock_guard guard(mutex_);
+        auto& producer = producers_[key];
+        if (producer) {
+            throw std::invalid_argument("ConcurrentDocument: producer key is already in use");
+        }
+        producer = std::make_unique<Producer>();
+        return *producer;
+    }
+
+    size_t ConcurrentDocument::Size() const {
+        std::lock_guard guard(mutex_);
+        size_t size = 0;
+        for (const auto& [key, producer] : producers_) {
+            size += producer->items_.size();
+        }
+        return size;
+    }
+
+    std::vector<const Object*> ConcurrentDocument::Ordered(StyleTable& styles) const {
+        std::lock_guard guard(mutex_);
+        std::vector<std::pair<int32_t, const Object*>> items;
+        for (const auto& [key, producer] : producers_) {
+            styles.Merge(producer->styles_);
+            for (const auto& item : producer->items_) {
+                items.emplace_back(item.layer, item.object.get());
+            }
+        }
+        // Внутри слоя сохраняется порядок (ключ производителя, номер объекта)
+        std::stable_sort(items.begin(), items.end(), [](const auto& lhs, const auto& rhs) {
+            return lhs.first < rhs.first;
+        });
+
+        std::vector<const Object*> ordered;
+        ordered.reserve(items.size());
+        for (const auto& [layer, object] : items) {
+            ordered.push_back(object);
+        }
+        return ordered;
+    }
+
+    void ConcurrentDocument::Render(std::ostream& out, const RenderOptions& options) const {
+        OstreamSink sink(out);
+        StyleTable styles;
+        const auto ordered = Ordered(styles);
+        RenderObjects(sink, options, styles, nullptr, ordered.size(),
+                      [&ordered](const RenderContext& context, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                ordered[i]->Render(context);
+            }
+        });
+    }
+
+    void ConcurrentDocument::Render(OutputBuffer& out, const RenderOptions& options) const {
+        StyleTable styles;
+        const auto ordered = Ordered(styles);
+        RenderHeader(out, options.style_classes ? &styles : nullptr);
+        const RenderContext context = MakeContext(out, options, styles);
+        for (const Object* object : ordered) {
+            object->Render(context);
+        }
+        RenderFooter(out);
+    }
+
+    void ConcurrentDocument::Render(OutputSink& out, const RenderOptions& options) const {
+        StyleTable styles;
+        const auto ordered = Ordered(styles);
+        RenderObjects(out, options, styles, nullptr, ordered.size(),
+                      [&ordered](const RenderContext& context, size_t begin, size_t end) {
+            for (size_t i = begin; i < end; ++i) {
+                ordered[i]->Render(context);
+            }
+        });
+        out.Finish();
+    }
+
 }
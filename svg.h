@@ -1,11 +1,20 @@
 #pragma once
 
+#include <algorithm>
+#include <charconv>
 #include <cstdint>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 #include <deque>
+#include <exception>
 #include <optional>
 #include <variant>
  
@@ -34,10 +43,127 @@ struct Rgba {
 
     using Color = std::variant<std::monostate, std::string, svg::Rgb, svg::Rgba>;
 
+bool operator==(const Rgb& lhs, const Rgb& rhs);
+bool operator!=(const Rgb& lhs, const Rgb& rhs);
+bool operator==(const Rgba& lhs, const Rgba& rhs);
+bool operator!=(const Rgba& lhs, const Rgba& rhs);
+
+// Непрерывный буфер, в который сериализуется документ. Числа пишутся через
+// std::to_chars с заданным числом значащих цифр (по умолчанию 6, как у
+// std::ostream), а в поток весь текст уходит одним вызовом WriteTo.
+//
+// Для наследников Object, которые писали в context.out как в std::ostream:
+// operator<< принимает строки (std::string, const char*, std::string_view),
+// char, bool (1 или 0, как std::ostream без std::boolalpha), целые, float и
+// double, а также StrokeLineCap и StrokeLineJoin. Манипуляторов (std::endl,
+// std::setprecision) нет: перевод строки - '\n', точность задаётся в
+// RenderOptions. Цвет выводится через std::visit(ColorPrinter{out}, color),
+// для остальных типов нужна своя перегрузка operator<<(OutputBuffer&, T)
+class OutputBuffer {
+public:
+    explicit OutputBuffer(int precision = 6)
+        : precision_(precision) {
+    }
+
+    OutputBuffer& operator<<(std::string_view str) {
+        data_.append(str);
+        return *this;
+    }
+
+    OutputBuffer& operator<<(char ch) {
+        data_.push_back(ch);
+        return *this;
+    }
+
+    OutputBuffer& operator<<(double value);
+
+    // Шаблон, чтобы строковые литералы не приводились к bool
+    template <typename T, std::enable_if_t<std::is_same_v<T, bool>, int> = 0>
+    OutputBuffer& operator<<(T value) {
+        data_.push_back(value ? '1' : '0');
+        return *this;
+    }
+
+    template <typename T, std::enable_if_t<std::is_integral_v<T> && !std::is_same_v<T, char>
+                                           && !std::is_same_v<T, bool>, int> = 0>
+    OutputBuffer& operator<<(T value) {
+        char buffer[24];
+        auto [end, ec] = std::to_chars(buffer, buffer + sizeof(buffer), value);
+        data_.append(buffer, end);
+        return *this;
+    }
+
+    void put(char ch) {
+        data_.push_back(ch);
+    }
+
+    void Reserve(size_t size) {
+        data_.reserve(size);
+    }
+
+    void Clear() {
+        data_.clear();
+    }
+
+    size_t Size() const {
+        return data_.size();
+    }
+
+    std::string_view View() const {
+        return data_;
+    }
+
+    int Precision() const {
+        return precision_;
+    }
+
+    // Число с фиксированным числом знаков после запятой без хвостовых нулей
+    void AppendFixed(double value, int decimals);
+
+    void WriteTo(std::ostream& out) const {
+        out.write(data_.data(), static_cast<std::streamsize>(data_.size()));
+    }
+
+private:
+    std::string data_;
+    int precision_;
+};
+
+// Получатель готового текста документа. Запись идёт крупными блоками,
+// поэтому приёмник может сжимать или передавать данные без своей буферизации
+class OutputSink {
+public:
+    virtual void Write(std::string_view data) = 0;
+
+    // Вызывается один раз после последнего Write
+    virtual void Finish() {
+    }
+
+    virtual ~OutputSink() = default;
+};
+
+class OstreamSink final : public OutputSink {
+public:
+    explicit OstreamSink(std::ostream& out)
+        : out_(out) {
+    }
+
+    void Write(std::string_view data) override {
+        out_.write(data.data(), static_cast<std::streamsize>(data.size()));
+    }
+
+    void Finish() override {
+        out_.flush();
+    }
+
+private:
+    std::ostream& out_;
+};
+
 struct ColorPrinter {
-    std::ostream& out;
+    OutputBuffer& out;
     void operator() (std::monostate);
-    void operator() (std::string color);
+    void operator() (const std::string& color);
     void operator() (svg::Rgb color);
     void operator() (svg::Rgba color);
 };
@@ -63,6 +189,10 @@ std::ostream& StrokeLineJoinOutput(std::ostream& out, svg::StrokeLineJoin join);
 std::ostream& operator<<(std::ostream& os, svg::StrokeLineCap cap);
     
 std::ostream& operator<<(std::ostream& os, svg::StrokeLineJoin join);
+
+OutputBuffer& operator<<(OutputBuffer& out, svg::StrokeLineCap cap);
+
+OutputBuffer& operator<<(OutputBuffer& out, svg::StrokeLineJoin join);
  
 struct Point {
     Point() = default;
@@ -73,20 +203,137 @@ struct Point {
     double x = 0;
     double y = 0;
 };
+
+// Прямоугольник со сторонами вдоль осей: границы объекта или область вывода
+struct Rect {
+    double min_x = 0;
+    double min_y = 0;
+    double max_x = 0;
+    double max_y = 0;
+
+    double Width() const {
+        return max_x - min_x;
+    }
+
+    double Height() const {
+        return max_y - min_y;
+    }
+
+    // Касание границами считается пересечением
+    bool Intersects(const Rect& other) const {
+        return min_x <= other.max_x && other.min_x <= max_x && min_y <= other.max_y && other.min_y <= max_y;
+    }
+};
  
+// Оформление контура и заливки фигуры (атрибуты fill, stroke и т.д.)
+struct PathStyle {
+    std::optional<Color> fill_color;
+    std::optional<Color> stroke_color;
+    std::optional<double> stroke_width;
+    std::optional<StrokeLineCap> stroke_line_cap;
+    std::optional<StrokeLineJoin> stroke_line_join;
+
+    bool operator==(const PathStyle& other) const;
+    bool operator!=(const PathStyle& other) const {
+        return !(*this == other);
+    }
+};
+
+struct PathStyleHasher {
+    size_t operator()(const PathStyle& style) const;
+};
+
+// Выводит стиль атрибутами элемента: fill="..." stroke="..."
+void RenderStyleAttributes(OutputBuffer& out, const PathStyle& style);
+
+// Таблица уникальных стилей документа. Фигуры с одинаковым оформлением
+// хранят один общий экземпляр стиля, а при выводе с классами каждый стиль
+// попадает в блок <style> один раз и подключается через class="sN"
+class StyleTable {
+public:
+    // Возвращает общий экземпляр, равный style, добавляя его при необходимости
+    std::shared_ptr<PathStyle> Intern(std::shared_ptr<PathStyle> style);
+
+    // Номер стиля по общему экземпляру; nullopt для стиля не из таблицы
+    std::optional<size_t> Find(const PathStyle* style) const;
+
+    size_t Size() const {
+        return styles_.size() - free_ids_.size();
+    }
+
+    // Блок <style> с правилом .sN для каждого стиля
+    void RenderCss(OutputBuffer& out) const;
+
+    // Добавляет стили другой таблицы. Find находит и экземпляры other,
+    // совпавшие со стилями этой таблицы
+    void Merge(const StyleTable& other);
+
+    // Удаляет стили, которыми не пользуется ни одна фигура, и возвращает их
+    // число. Номера остальных стилей не меняются, освободившиеся номера
+    // достаются новым стилям. Не для таблиц, собранных через Merge
+    size_t ReleaseUnused();
+
+private:
+    // Свободный номер для нового стиля
+    size_t NextId();
+
+    // Освобождённые места - nullptr
+    std::vector<std::shared_ptr<PathStyle>> styles_;
+    std::vector<size_t> free_ids_;
+    // Экземпляры из Merge, равные уже известным; хранятся, чтобы их адреса
+    // в ids_by_address_ не достались другим стилям
+    std::vector<std::shared_ptr<PathStyle>> aliases_;
+    std::unordered_map<PathStyle, size_t, PathStyleHasher> ids_;
+    std::unordered_map<const PathStyle*, size_t> ids_by_address_;
+};
+
+enum class PolylineSimplification {
+    NONE,
+    DOUGLAS_PEUCKER,
+    VISVALINGAM_WHYATT,
+};
+
+// Параметры сериализации документа
+struct RenderOptions {
+    // Число значащих цифр в координатах и размерах
+    int precision = 6;
+    // Потоков для вывода в std::ostream: объекты делятся на блоки, каждый
+    // блок сериализуется в свой буфер, а буферы пишутся в исходном порядке.
+    // 0 - по числу ядер. Результат побайтно совпадает с однопоточным
+    size_t threads = 1;
+    // Выводить общие стили блоком <style> и ссылаться на них через class
+    bool style_classes = false;
+
+    // Упрощение ломаных при выводе; допуск задаётся в единицах координат
+    // вывода (для Visvalingam-Whyatt удаляются точки с площадью треугольника
+    // меньше квадрата допуска)
+    PolylineSimplification simplification = PolylineSimplification::NONE;
+    double simplify_tolerance = 0.0;
+    // Число знаков после запятой в координатах ломаных; совпавшие после
+    // округления соседние точки выводятся один раз
+    std::optional<int> coordinate_decimals;
+    // Выводить ломаные как <path d="M x,y l dx,dy ..."> с относительными смещениями
+    bool polyline_as_path = false;
+};
+
 struct RenderContext {
-    RenderContext(std::ostream& out)
-        : out(out) {
+    RenderContext(OutputBuffer& out, const StyleTable* styles = nullptr, const RenderOptions* options = nullptr)
+        : out(out)
+        , styles(styles)
+        , options(options) {
     }
  
-    RenderContext(std::ostream& out, int indent_step, int indent = 0)
+    RenderContext(OutputBuffer& out, int indent_step, int indent = 0, const StyleTable* styles = nullptr,
+                  const RenderOptions* options = nullptr)
         : out(out)
         , indent_step(indent_step)
-        , indent(indent) {
+        , indent(indent)
+        , styles(styles)
+        , options(options) {
     }
  
     RenderContext Indented() const {
-        return {out, indent_step, indent + indent_step};
+        return {out, indent_step, indent + indent_step, styles, options};
     }
  
     void RenderIndent() const {
@@ -95,110 +342,170 @@ struct RenderContext {
         }
     }
  
-    std::ostream& out;
+    OutputBuffer& out;
     int indent_step = 0;
     int indent = 0;
+    // Если задана, стили из неё выводятся ссылкой class="sN"
+    const StyleTable* styles = nullptr;
+    // Параметры вывода документа; nullptr - значения по умолчанию
+    const RenderOptions* options = nullptr;
 };
  
 template <typename Owner>
 class PathProps {
 public:
     Owner& SetFillColor(Color color) {
-        fill_color_ = std::move(color);
+        MutableStyle().fill_color = std::move(color);
         return AsOwner();
     }
     
     Owner& SetStrokeColor(Color color) {
-        stroke_color_ = std::move(color);
+        MutableStyle().stroke_color = std::move(color);
         return AsOwner();
     }
     
     Owner& SetStrokeWidth(double width) {
-        stroke_width_ = std::move(width);
+        MutableStyle().stroke_width = width;
         return AsOwner();
     }
     
     Owner& SetStrokeLineCap(StrokeLineCap line_cap) {
-        stroke_line_cap_ = std::move(line_cap);
+        MutableStyle().stroke_line_cap = line_cap;
         return AsOwner();
     }
     
     Owner& SetStrokeLineJoin(StrokeLineJoin line_join) {
-        stroke_line_join_ = std::move(line_join);
+        MutableStyle().stroke_line_join = line_join;
         return AsOwner();
     }
+
+    // nullptr, если стиль не задавался
+    const PathStyle* GetStyle() const {
+        return style_.get();
+    }
 private:
-    std::optional<Color> fill_color_;
-    std::optional<Color> stroke_color_;
-    std::optional<double> stroke_width_;
-    std::optional<StrokeLineCap> stroke_line_cap_;
-    std::optional<StrokeLineJoin> stroke_line_join_;
+    // Стиль может быть общим с другими фигурами, поэтому копируется при записи
+    std::shared_ptr<PathStyle> style_;
     
     Owner& AsOwner() {
         return static_cast<Owner&>(*this);
     }
-    
-    void RenderFillColor(std::ostream& out) const {
-        if (fill_color_) {
-            out << " fill=\"";
-            std::visit(ColorPrinter{out}, *fill_color_);
-            out<<"\"";
+
+    PathStyle& MutableStyle() {
+        AsOwner().Invalidate();
+        if (!style_) {
+            style_ = std::make_shared<PathStyle>();
+        } else if (style_.use_count() > 1) {
+            style_ = std::make_shared<PathStyle>(*style_);
         }
+        return *style_;
     }
+protected:
+    // Объявленный деструктор подавил бы неявное перемещение стиля
+    PathProps() = default;
+    PathProps(const PathProps&) = default;
+    PathProps(PathProps&&) noexcept = default;
+    PathProps& operator=(const PathProps&) = default;
+    PathProps& operator=(PathProps&&) noexcept = default;
+    ~PathProps() = default;
     
-    void RenderStrokeColor(std::ostream& out) const {
-        if (stroke_color_) {
-            out << " stroke=\"";
-            std::visit(ColorPrinter{out}, *stroke_color_);
-            out <<"\"";
+    void RenderAttrs(const RenderContext& context) const {
+        if (!style_) {
+            return;
         }
-    }
-    
-    void RenderStrokeWidth(std::ostream& out) const {
-        if (stroke_width_) {
-            out << " stroke-width=\"" << *stroke_width_ << "\"";
+        if (context.styles != nullptr) {
+            if (const auto id = context.styles->Find(style_.get())) {
+                context.out << " class=\"s" << *id << "\"";
+                return;
+            }
         }
+        RenderStyleAttributes(context.out, *style_);
     }
-    
-    void RenderStrokeLineCap(std::ostream& out) const {
-        if(stroke_line_cap_) {
-            out << " stroke-linecap=\""<< *stroke_line_cap_<<"\"";
+
+    // Насколько обводка выходит за геометрию фигуры
+    double StrokeOutset() const {
+        if (!style_ || !style_->stroke_color) {
+            return 0.0;
         }
+        return style_->stroke_width.value_or(1.0) / 2.0;
     }
-    
-    void RenderStrokeLineJoin(std::ostream& out) const {
-        if(stroke_line_join_) {
-            out << " stroke-linejoin=\"" << *stroke_line_join_ << "\"";
+
+    void ShareStyle(StyleTable& styles) {
+        if (style_) {
+            style_ = styles.Intern(std::move(style_));
         }
     }
-protected:
-    ~PathProps() = default;
-    
-    void RenderAttrs(std::ostream& out) const {
-        RenderFillColor(out);
-        RenderStrokeColor(out);
-        RenderStrokeWidth(out);
-        RenderStrokeLineCap(out);
-        RenderStrokeLineJoin(out);
-    }
 };
  
 class Object {
 public:
     void Render(const RenderContext& context) const;
+
+    // Заменяет стиль объекта общим экземпляром из таблицы документа
+    virtual void InternStyle(StyleTable& styles) {
+        (void)styles;
+    }
+
+    // Границы объекта с учётом обводки. nullopt - границы неизвестны,
+    // такой объект выводится в любую область
+    virtual std::optional<Rect> BoundingBox() const {
+        return std::nullopt;
+    }
+ 
+    // Номер версии: растёт при каждом изменении объекта через сеттеры,
+    // по нему RetainedDocument узнаёт устаревшие фрагменты
+    uint64_t Revision() const {
+        return revision_;
+    }
  
     virtual ~Object() = default;
  
+protected:
+    Object() = default;
+    Object(const Object&) = default;
+    Object(Object&&) noexcept = default;
+
+    // Присваивание - тоже изменение: версия не копируется, а становится больше
+    // обеих, иначе фигура, собранная той же цепочкой сеттеров, совпала бы по
+    // версии с уже выведенной и RetainedDocument не заметил бы замены
+    Object& operator=(const Object& other) {
+        revision_ = std::max(revision_, other.revision_) + 1;
+        return *this;
+    }
+
+    Object& operator=(Object&& other) noexcept {
+        revision_ = std::max(revision_, other.revision_) + 1;
+        return *this;
+    }
+
+    // Вызывается подклассами из каждого изменяющего метода
+    void Invalidate() {
+        ++revision_;
+    }
+
 private:
+    template <typename Owner>
+    friend class PathProps;
+
+    uint64_t revision_ = 0;
+
     virtual void RenderObject(const RenderContext& context) const = 0;
 };
  
 class Circle final : public Object, public PathProps<Circle> {
 public:
+    void InternStyle(StyleTable& styles) override {
+        ShareStyle(styles);
+    }
+
+    std::optional<Rect> BoundingBox() const override;
+
     Circle& SetCenter(Point center);
     Circle& SetRadius(double radius);
  
 private:
+    friend class PooledDocument;
+
     void RenderObject(const RenderContext& context) const override;
  
     Point center_;
@@ -207,16 +514,36 @@ private:
  
 class Polyline final : public Object, public PathProps<Polyline> {
 public:
+    void InternStyle(StyleTable& styles) override {
+        ShareStyle(styles);
+    }
+
+    // Углы соединений учитываются с запасом по stroke-miterlimit (4)
+    std::optional<Rect> BoundingBox() const override;
+
     Polyline& AddPoint(Point point);
  
 private:
+    friend class PooledDocument;
+
     std::vector<Point> points_;
     
     void RenderObject(const RenderContext& context) const override;
+
+    // Вывод с точками из внешнего хранилища (общий буфер PooledDocument)
+    void RenderPoints(const RenderContext& context, const Point* begin, const Point* end) const;
 };
  
 class Text final : public Object, public PathProps<Text> {
 public:
+    void InternStyle(StyleTable& styles) override {
+        ShareStyle(styles);
+    }
+
+    // Оценка сверху: ширина символа не больше font-size, а символов не
+    // больше, чем байтов UTF-8 в строке
+    std::optional<Rect> BoundingBox() const override;
+
     Text& SetPosition(Point pos);
  
     // Задаёт смещение относительно опорной точки (атрибуты dx, dy)
@@ -242,6 +569,8 @@ private:
     uint32_t font_size_ = 1;
     std::string font_weight_;
     
+    friend class PooledDocument;
+
     void RenderObject(const RenderContext& context) const override;
 };
     
@@ -249,25 +578,382 @@ class ObjectContainer {
 public:
     template <typename T>
     void Add(T obj) {
-        AddPtr(std::move(std::make_unique<T>(obj)));
+        if constexpr (std::is_same_v<T, Circle> || std::is_same_v<T, Polyline> || std::is_same_v<T, Text>) {
+            AddObject(std::move(obj));
+        } else {
+            AddPtr(std::make_unique<T>(std::move(obj)));
+        }
     }
     
     virtual void AddPtr(std::unique_ptr<Object>&& obj) = 0;
  
     virtual ~ObjectContainer() = default;
+
+protected:
+    // Встроенные фигуры приходят по значению, так что контейнер может хранить
+    // их без отдельного выделения памяти. По умолчанию они уходят в AddPtr
+    virtual void AddObject(Circle&& circle);
+    virtual void AddObject(Polyline&& polyline);
+    virtual void AddObject(Text&& text);
 };
  
+// Равномерная сетка над границами объектов: объект записывается во все
+// ячейки, которые пересекает. Объекты без границ и слишком крупные для сетки
+// хранятся отдельным списком и проверяются при каждом запросе
+class GridIndex {
+public:
+    explicit GridIndex(double cell_size);
+
+    // Номера объектов идут подряд с нуля
+    void Insert(const std::optional<Rect>& box);
+
+    size_t Size() const {
+        return boxes_.size();
+    }
+
+    // Добавляет в result номера объектов, пересекающих area, по возрастанию
+    void Query(const Rect& area, std::vector<uint32_t>& result) const;
+
+    bool Intersects(uint32_t id, const Rect& area) const {
+        const auto& box = boxes_[id];
+        return !box || box->Intersects(area);
+    }
+
+private:
+    // Объект, занимающий больше ячеек, идёт в список крупных
+    static constexpr int64_t MAX_CELLS_PER_OBJECT = 64;
+
+    struct CellRange {
+        int64_t min_x;
+        int64_t min_y;
+        int64_t max_x;
+        int64_t max_y;
+
+        int64_t Count() const {
+            return (max_x - min_x + 1) * (max_y - min_y + 1);
+        }
+    };
+
+    std::optional<CellRange> Cells(const Rect& area) const;
+
+    static uint64_t CellKey(int64_t x, int64_t y) {
+        return (static_cast<uint64_t>(static_cast<uint32_t>(x)) << 32) | static_cast<uint32_t>(y);
+    }
+
+    double cell_size_;
+    std::vector<std::optional<Rect>> boxes_;
+    std::unordered_map<uint64_t, std::vector<uint32_t>> cells_;
+    // Объекты без границ или вне сетки
+    std::vector<uint32_t> unindexed_;
+};
+
+struct TileId {
+    int zoom = 0;
+    int x = 0;
+    int y = 0;
+};
+
+// Пирамида тайлов: на уровне zoom область bounds делится на 2^zoom x 2^zoom
+// тайлов, тайл (0, 0) - левый верхний
+struct TilePyramid {
+    Rect bounds;
+    int min_zoom = 0;
+    int max_zoom = 0;
+    // Размер тайла в пикселях (атрибуты width и height)
+    double tile_size = 256;
+};
+
+// Получает готовый SVG тайла; текст действителен только во время вызова
+using TileSink = std::function<void(const TileId& tile, std::string_view svg)>;
+
 class Document : public ObjectContainer {
 public:
+    Document()
+        : Document(DEFAULT_INDEX_CELL_SIZE) {
+    }
+
+    // Размер ячейки пространственного индекса в единицах координат сцены.
+    // Индекс строится только при первом выводе области или тайлов
+    explicit Document(double index_cell_size);
     
     void AddPtr(std::unique_ptr<Object>&& obj) override;
  
-    void Render(std::ostream& out) const;
+    // Сериализует документ в буфер и сбрасывает его в поток одной записью
+    void Render(std::ostream& out, const RenderOptions& options = {}) const;
+
+    // Точность чисел задаёт сам буфер, из options берутся остальные параметры
+    void Render(OutputBuffer& out, const RenderOptions& options = {}) const;
+
+    // Передаёт текст приёмнику блоками по мере готовности и завершает его
+    void Render(OutputSink& out, const RenderOptions& options = {}) const;
+
+    // Выводит только объекты, пересекающие viewport, с viewBox="viewport"
+    void Render(std::ostream& out, const Rect& viewport, const RenderOptions& options = {}) const;
+
+    void Render(OutputBuffer& out, const Rect& viewport, const RenderOptions& options = {}) const;
+
+    // Выводит все тайлы пирамиды от min_zoom до max_zoom за один проход:
+    // кандидаты тайла отбираются из кандидатов родителя, а каждый объект
+    // сериализуется один раз и затем только копируется в свои тайлы.
+    // Тайлы без объектов в sink не передаются, и их потомки не обходятся
+    void RenderTiles(const TilePyramid& pyramid, const TileSink& sink, const RenderOptions& options = {}) const;
+
+    const StyleTable& Styles() const {
+        return styles_;
+    }
  
 private:
+    static constexpr double DEFAULT_INDEX_CELL_SIZE = 256.0;
+
+    void RenderRange(const RenderContext& context, size_t begin, size_t end) const;
+
+    // Индекс по всем объектам; при первом вызове строится, потом дополняется
+    // добавленными с тех пор объектами
+    const GridIndex& Index() const;
+
     std::vector<std::unique_ptr<Object>> objects_;
+    StyleTable styles_;
+    double index_cell_size_;
+    // Документ без вывода областей не тратит память и время на индекс.
+    // Мьютекс в куче, чтобы документ оставался перемещаемым
+    mutable std::optional<GridIndex> index_;
+    mutable std::unique_ptr<std::mutex> index_mutex_ = std::make_unique<std::mutex>();
+};
+
+// Документ с раздельным хранением по типам: круги, ломаные и тексты лежат
+// в непрерывных массивах, точки всех ломаных - в одном общем буфере, а порядок
+// вывода задаёт компактный индекс. Встроенные фигуры добавляются без выделения
+// памяти под каждый объект и выводятся без виртуальных вызовов
+class PooledDocument : public ObjectContainer {
+public:
+    void AddPtr(std::unique_ptr<Object>&& obj) override;
+
+    // Резервирует место, если размеры сцены известны заранее
+    void Reserve(size_t circles, size_t polylines, size_t texts, size_t points);
+
+    size_t Size() const {
+        return order_.size();
+    }
+
+    void Render(std::ostream& out, const RenderOptions& options = {}) const;
+
+    void Render(OutputBuffer& out, const RenderOptions& options = {}) const;
+
+    void Render(OutputSink& out, const RenderOptions& options = {}) const;
+
+    const StyleTable& Styles() const {
+        return styles_;
+    }
+
+protected:
+    void AddObject(Circle&& circle) override;
+    void AddObject(Polyline&& polyline) override;
+    void AddObject(Text&& text) override;
+
+private:
+    // Элемент индекса: тип в старших двух битах, номер в своём массиве в остальных
+    enum class Kind : uint32_t {
+        CIRCLE,
+        POLYLINE,
+        TEXT,
+        OTHER,
+    };
+    static constexpr int KIND_SHIFT = 30;
+    static constexpr uint32_t INDEX_MASK = (uint32_t{1} << KIND_SHIFT) - 1;
+
+    struct PointRange {
+        uint32_t offset = 0;
+        uint32_t count = 0;
+    };
+
+    void AddToOrder(Kind kind, size_t index);
+
+    void RenderRange(const RenderContext& context, size_t begin, size_t end) const;
+
+    std::vector<Circle> circles_;
+    std::vector<Polyline> polylines_;
+    std::vector<PointRange> polyline_points_;
+    std::vector<Point> points_;
+    std::vector<Text> texts_;
+    std::vector<std::unique_ptr<Object>> others_;
+    std::vector<uint32_t> order_;
+    StyleTable styles_;
 };
     
+// Документ для многократного вывода с небольшими изменениями между кадрами.
+// Каждый объект хранит свой сериализованный фрагмент; Render пересобирает
+// только фрагменты объектов, чья версия изменилась, а остальные копирует.
+// Фрагменты сбрасываются, если меняются параметры вывода
+class RetainedDocument : public ObjectContainer {
+public:
+    // Идентификатор объекта; порядок вывода совпадает с порядком добавления
+    using Id = uint64_t;
+
+    void AddPtr(std::unique_ptr<Object>&& obj) override;
+
+    // Добавляет объект и возвращает его идентификатор
+    template <typename T>
+    Id Insert(T obj) {
+        Add(std::move(obj));
+        return next_id_ - 1;
+    }
+
+    // Объект для изменения на месте; сеттеры сами отмечают его фрагмент
+    // устаревшим. Бросает std::out_of_range, если объекта нет, и
+    // std::bad_cast, если он другого типа
+    template <typename T>
+    T& Get(Id id) {
+        return dynamic_cast<T&>(*FindEntry(id).object);
+    }
+
+    // Заменяет объект, сохраняя его место в порядке вывода
+    void Replace(Id id, std::unique_ptr<Object>&& obj);
+
+    // false, если объекта с таким идентификатором нет
+    bool Remove(Id id);
+
+    size_t Size() const {
+        return entries_.size();
+    }
+
+    // Не const: обновляет кэш фрагментов
+    void Render(std::ostream& out, const RenderOptions& options = {});
+
+    void Render(OutputBuffer& out, const RenderOptions& options = {});
+
+    const StyleTable& Styles() const {
+        return styles_;
+    }
+
+private:
+    struct Entry {
+        std::unique_ptr<Object> object;
+        std::string fragment;
+        // Версия объекта, с которой собран fragment
+        std::optional<uint64_t> rendered_revision;
+    };
+
+    Entry& FindEntry(Id id);
+
+    // Пересобирает устаревшие фрагменты; возвращает суммарный размер
+    size_t RefreshFragments(const RenderOptions& options);
+
+    std::map<Id, Entry> entries_;
+    Id next_id_ = 0;
+    StyleTable styles_;
+    // Параметры, с которыми собраны фрагменты
+    std::optional<RenderOptions> cached_options_;
+    OutputBuffer scratch_;
+};
+
+// Документ, который наполняют несколько потоков одновременно. Каждый поток
+// получает своего производителя и добавляет объекты в его буфер без
+// блокировок. Порядок вывода не зависит от планирования потоков: объекты
+// упорядочены по слою, затем по ключу производителя, затем по порядку
+// добавления. Render нельзя вызывать, пока производители добавляют объекты
+class ConcurrentDocument {
+public:
+    class Producer : public ObjectContainer {
+    public:
+        // Слой последующих объектов; меньшие слои выводятся раньше
+        void SetLayer(int32_t layer) {
+            layer_ = layer;
+        }
+
+        void AddPtr(std::unique_ptr<Object>&& obj) override;
+
+        size_t Size() const {
+            return items_.size();
+        }
+
+    private:
+        friend class ConcurrentDocument;
+
+        struct Item {
+            int32_t layer;
+            std::unique_ptr<Object> object;
+        };
+
+        std::vector<Item> items_;
+        // Своя таблица стилей: общая потребовала бы блокировки
+        StyleTable styles_;
+        int32_t layer_ = 0;
+    };
+
+    // Производитель с ключом key. Бросает std::invalid_argument, если ключ
+    // уже занят. Можно вызывать из разных потоков; ссылка действительна,
+    // пока жив документ
+    Producer& MakeProducer(uint32_t key);
+
+    size_t Size() const;
+
+    void Render(std::ostream& out, const RenderOptions& options = {}) const;
+
+    void Render(OutputBuffer& out, const RenderOptions& options = {}) const;
+
+    void Render(OutputSink& out, const RenderOptions& options = {}) const;
+
+private:
+    // Объекты в порядке вывода и общая таблица стилей всех производителей
+    std::vector<const Object*> Ordered(StyleTable& styles) const;
+
+    mutable std::mutex mutex_;
+    std::map<uint32_t, std::unique_ptr<Producer>> producers_;
+};
+
+// Пишет документ по мере добавления объектов: заголовок выводится в
+// конструкторе, каждый объект сериализуется сразу в Add/AddPtr и не
+// хранится, а накопленный текст уходит в приёмник блоками по FLUSH_THRESHOLD
+// байт. Память не зависит от размера сцены. Параметры style_classes и
+// threads не поддерживаются: блок <style> пришлось бы писать до объектов
+class StreamWriter : public ObjectContainer {
+public:
+    static constexpr size_t FLUSH_THRESHOLD = 64 * 1024;
+
+    explicit StreamWriter(std::ostream& out, const RenderOptions& options = {});
+
+    // Приёмник должен жить дольше писателя
+    explicit StreamWriter(OutputSink& sink, const RenderOptions& options = {});
+
+    StreamWriter(const StreamWriter&) = delete;
+    StreamWriter& operator=(const StreamWriter&) = delete;
+
+    // Закрывает документ, если Close не вызывался; ошибки при этом теряются.
+    // При разрушении из-за исключения документ не закрывается и Finish не
+    // вызывается: оборванный вывод не должен выглядеть законченным SVG
+    ~StreamWriter() override;
+
+    void AddPtr(std::unique_ptr<Object>&& obj) override;
+
+    // Выводит </svg> и сбрасывает остаток в приёмник. Повторный вызов
+    // ничего не делает, добавление после закрытия бросает std::logic_error
+    void Close();
+
+    // Объём текста, переданного в приёмник и ожидающего передачи
+    uint64_t BytesWritten() const {
+        return flushed_ + buffer_.Size();
+    }
+
+protected:
+    void AddObject(Circle&& circle) override;
+    void AddObject(Polyline&& polyline) override;
+    void AddObject(Text&& text) override;
+
+private:
+    void Start();
+    void Write(const Object& obj);
+    void Flush();
+
+    std::unique_ptr<OstreamSink> own_sink_;
+    OutputSink& sink_;
+    RenderOptions options_;
+    OutputBuffer buffer_;
+    uint64_t flushed_ = 0;
+    bool closed_ = false;
+    // Число активных исключений при создании: больше в деструкторе - раскрутка
+    const int uncaught_exceptions_ = std::uncaught_exceptions();
+};
+
 class Drawable {
 public:
     virtual void Draw(ObjectContainer& container) const = 0;
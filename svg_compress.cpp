@@ -0,0 +1,234 @@
+#include "svg_compress.hpp"
+
+#include <algorithm>
+#include <limits>
+
+#include <zlib.h>
+
+#ifdef SVG_WITH_ZSTD
+#include <zstd.h>
+#endif
+
+namespace svg {
+
+namespace {
+
+// Размер блока сжатых данных, передаваемого следующему приёмнику
+constexpr size_t COMPRESSED_BLOCK_BYTES = 128 * 1024;
+
+}  // namespace
+
+// ---------- GzipSink ------------------
+
+struct GzipSink::State {
+    z_stream stream{};
+};
+
+GzipSink::GzipSink(OutputSink& out, int level)
+    : out_(out)
+    , state_(std::make_unique<State>()) {
+    // 15 - окно 32 КиБ, +16 - заголовок и контрольная сумма gzip вместо zlib
+    if (deflateInit2(&state_->stream, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw CompressionError("GzipSink: deflateInit2 failed");
+    }
+    compressed_.resize(COMPRESSED_BLOCK_BYTES);
+}
+
+GzipSink::~GzipSink() {
+    deflateEnd(&state_->stream);
+}
+
+void GzipSink::Write(std::string_view data) {
+    if (finished_) {
+        throw std::logic_error("GzipSink: write after Finish");
+    }
+    // avail_in - 32-битное поле
+    constexpr size_t MAX_PIECE = std::numeric_limits<uInt>::max() / 2;
+    while (!data.empty()) {
+        const size_t piece = std::min(data.size(), MAX_PIECE);
+        Deflate(data.substr(0, piece), Z_NO_FLUSH);
+        data.remove_prefix(piece);
+    }
+}
+
+void GzipSink::Finish() {
+    if (finished_) {
+        return;
+    }
+    finished_ = true;
+    Deflate({}, Z_FINISH);
+    out_.Finish();
+}
+
+void GzipSink::Deflate(std::string_view data, int flush) {
+    z_stream& stream = state_->stream;
+    stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    stream.avail_in = static_cast<uInt>(data.size());
+    while (true) {
+        stream.next_out = reinterpret_cast<Bytef*>(compressed_.data());
+        stream.avail_out = static_cast<uInt>(compressed_.size());
+        const int result = deflate(&stream, flush);
+        if (result == Z_STREAM_ERROR) {
+            throw CompressionError("GzipSink: deflate failed");
+        }
+        const size_t produced = compressed_.size() - stream.avail_out;
+        if (produced > 0) {
+            out_.Write(std::string_view(compressed_.data(), produced));
+        }
+        // Без Z_FINISH deflate забирает весь вход, пока есть место на выходе
+        const bool done = flush == Z_FINISH ? result == Z_STREAM_END : stream.avail_out != 0;
+        if (done) {
+            return;
+        }
+    }
+}
+
+// ---------- ZstdSink ------------------
+
+#ifdef SVG_WITH_ZSTD
+struct ZstdSink::State {
+    ZSTD_CCtx* context = nullptr;
+};
+
+ZstdSink::ZstdSink(OutputSink& out, int level)
+    : out_(out)
+    , state_(std::make_unique<State>()) {
+    state_->context = ZSTD_createCCtx();
+    if (state_->context == nullptr) {
+        throw CompressionError("ZstdSink: ZSTD_createCCtx failed");
+    }
+    const size_t result = ZSTD_CCtx_setParameter(state_->context, ZSTD_c_compressionLevel, level);
+    if (ZSTD_isError(result)) {
+        ZSTD_freeCCtx(state_->context);
+        throw CompressionError(std::string("ZstdSink: ") + ZSTD_getErrorName(result));
+    }
+    compressed_.resize(std::max(COMPRESSED_BLOCK_BYTES, ZSTD_CStreamOutSize()));
+}
+
+ZstdSink::~ZstdSink() {
+    ZSTD_freeCCtx(state_->context);
+}
+
+void ZstdSink::Write(std::string_view data) {
+    if (finished_) {
+        throw std::logic_error("ZstdSink: write after Finish");
+    }
+    Compress(data, false);
+}
+
+void ZstdSink::Finish() {
+    if (finished_) {
+        return;
+    }
+    finished_ = true;
+    Compress({}, true);
+    out_.Finish();
+}
+
+void ZstdSink::Compress(std::string_view data, bool end) {
+    ZSTD_inBuffer input{data.data(), data.size(), 0};
+    while (true) {
+        ZSTD_outBuffer output{compressed_.data(), compressed_.size(), 0};
+        const size_t remaining = ZSTD_compressStream2(state_->context, &output, &input, end ? ZSTD_e_end : ZSTD_e_continue);
+        if (ZSTD_isError(remaining)) {
+            throw CompressionError(std::string("ZstdSink: ") + ZSTD_getErrorName(remaining));
+        }
+        if (output.pos > 0) {
+            out_.Write(std::string_view(compressed_.data(), output.pos));
+        }
+        const bool done = end ? remaining == 0 : input.pos == input.size;
+        if (done) {
+            return;
+        }
+    }
+}
+#endif
+
+// ---------- BackgroundSink ------------------
+
+BackgroundSink::BackgroundSink(OutputSink& out, size_t max_pending_bytes)
+    : out_(out)
+    , max_pending_bytes_(max_pending_bytes)
+    , worker_([this] {
+        Run();
+    }) {
+}
+
+BackgroundSink::~BackgroundSink() {
+    Stop();
+}
+
+void BackgroundSink::Write(std::string_view data) {
+    std::unique_lock lock(mutex_);
+    if (stopping_) {
+        throw std::logic_error("BackgroundSink: write after Finish");
+    }
+    // Пустая очередь принимает блок любого размера, иначе писатель ждал бы вечно
+    changed_.wait(lock, [&] {
+        return error_ || pending_bytes_ == 0 || pending_bytes_ + data.size() <= max_pending_bytes_;
+    });
+    RethrowError();
+    blocks_.emplace_back(data);
+    pending_bytes_ += data.size();
+    changed_.notify_all();
+}
+
+void BackgroundSink::Finish() {
+    Stop();
+    std::lock_guard guard(mutex_);
+    RethrowError();
+    out_.Finish();
+}
+
+void BackgroundSink::Stop() {
+    {
+        std::lock_guard guard(mutex_);
+        if (stopping_) {
+            return;
+        }
+        stopping_ = true;
+    }
+    changed_.notify_all();
+    worker_.join();
+}
+
+void BackgroundSink::RethrowError() {
+    if (error_) {
+        std::rethrow_exception(error_);
+    }
+}
+
+void BackgroundSink::Run() {
+    std::unique_lock lock(mutex_);
+    while (true) {
+        changed_.wait(lock, [&] {
+            return !blocks_.empty() || stopping_;
+        });
+        if (blocks_.empty()) {
+            return;
+        }
+        std::string block = std::move(blocks_.front());
+        blocks_.pop_front();
+
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+            if (!error_) {
+                out_.Write(block);
+            }
+        } catch (...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+
+        // Блок учитывается, пока не записан: так ожидание в Write ограничивает
+        // и очередь, и блок в работе
+        pending_bytes_ -= block.size();
+        if (error && !error_) {
+            error_ = error;
+        }
+        changed_.notify_all();
+    }
+}
+
+}  // namespace svg
@@ -0,0 +1,121 @@
+#pragma once
+
+// Сжимающие приёмники для вывода SVG. Текст документа сжимается блоками по
+// мере сериализации, без промежуточной копии всего документа:
+//
+//     std::ofstream file("map.svgz", std::ios::binary);
+//     svg::OstreamSink file_sink(file);
+//     svg::GzipSink gzip(file_sink, 6);
+//     svg::BackgroundSink background(gzip);
+//     document.Render(background);
+//
+// Требует zlib (-lz). Поддержка zstd включается макросом SVG_WITH_ZSTD
+// (-DSVG_WITH_ZSTD -lzstd)
+
+#include "svg.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+namespace svg {
+
+// Ошибка библиотеки сжатия
+class CompressionError : public std::runtime_error {
+public:
+    using runtime_error::runtime_error;
+};
+
+// Формат gzip (.svgz) через zlib. level от 0 (без сжатия) до 9,
+// -1 - уровень zlib по умолчанию
+class GzipSink final : public OutputSink {
+public:
+    explicit GzipSink(OutputSink& out, int level = -1);
+    ~GzipSink() override;
+
+    GzipSink(const GzipSink&) = delete;
+    GzipSink& operator=(const GzipSink&) = delete;
+
+    void Write(std::string_view data) override;
+
+    // Завершает поток gzip и вызывает Finish у следующего приёмника
+    void Finish() override;
+
+private:
+    struct State;
+
+    void Deflate(std::string_view data, int flush);
+
+    OutputSink& out_;
+    std::unique_ptr<State> state_;
+    std::string compressed_;
+    bool finished_ = false;
+};
+
+#ifdef SVG_WITH_ZSTD
+// Формат zstd. level от 1 до 22, 0 - уровень библиотеки по умолчанию
+class ZstdSink final : public OutputSink {
+public:
+    explicit ZstdSink(OutputSink& out, int level = 0);
+    ~ZstdSink() override;
+
+    ZstdSink(const ZstdSink&) = delete;
+    ZstdSink& operator=(const ZstdSink&) = delete;
+
+    void Write(std::string_view data) override;
+
+    void Finish() override;
+
+private:
+    struct State;
+
+    void Compress(std::string_view data, bool end);
+
+    OutputSink& out_;
+    std::unique_ptr<State> state_;
+    std::string compressed_;
+    bool finished_ = false;
+};
+#endif
+
+// Передаёт блоки следующему приёмнику в отдельном потоке, так что сжатие и
+// запись идут параллельно с сериализацией. Write копирует блок в очередь и
+// ждёт только при max_pending_bytes непереданных байт. Ошибка следующего
+// приёмника выбрасывается из очередного Write или из Finish
+class BackgroundSink final : public OutputSink {
+public:
+    explicit BackgroundSink(OutputSink& out, size_t max_pending_bytes = 4 * 1024 * 1024);
+
+    // Дожидается передачи очереди; Finish следующего приёмника не вызывается
+    ~BackgroundSink() override;
+
+    BackgroundSink(const BackgroundSink&) = delete;
+    BackgroundSink& operator=(const BackgroundSink&) = delete;
+
+    void Write(std::string_view data) override;
+
+    // Дожидается передачи всех блоков и вызывает Finish следующего приёмника
+    void Finish() override;
+
+private:
+    void Run();
+    void Stop();
+    void RethrowError();
+
+    OutputSink& out_;
+    const size_t max_pending_bytes_;
+    std::deque<std::string> blocks_;
+    size_t pending_bytes_ = 0;
+    bool stopping_ = false;
+    std::exception_ptr error_;
+    std::mutex mutex_;
+    std::condition_variable changed_;
+    std::thread worker_;
+};
+
+}  // namespace svg
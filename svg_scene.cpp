@@ -0,0 +1,554 @@
+#include "svg_scene.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace svg {
+
+using namespace std::literals;
+
+namespace {
+
+// Значение поля объекта: скаляр или массив чисел глубины не больше двух
+struct FieldValue {
+    enum class Kind {
+        NONE,
+        NUMBER,
+        INTEGER,
+        STRING,
+        ARRAY,
+    };
+
+    Kind kind = Kind::NONE;
+    double number = 0.0;
+    std::string string;
+    // Числа массива подряд; для вложенных массивов - длины внутренних
+    std::vector<double> numbers;
+    std::vector<size_t> inner_sizes;
+    bool nested = false;
+
+    void Clear() {
+        kind = Kind::NONE;
+        string.clear();
+        numbers.clear();
+        inner_sizes.clear();
+        nested = false;
+    }
+};
+
+// Поля текущего объекта сцены до закрытия его словаря
+struct SceneObject {
+    std::string type;
+    PathStyle style;
+    std::optional<Point> center;
+    std::optional<double> radius;
+    std::vector<Point> points;
+    std::optional<Point> position;
+    std::optional<Point> offset;
+    std::optional<uint32_t> font_size;
+    std::optional<std::string> font_family;
+    std::optional<std::string> font_weight;
+    std::optional<std::string> data;
+
+    void Clear() {
+        type.clear();
+        style = {};
+        center.reset();
+        radius.reset();
+        points.clear();
+        position.reset();
+        offset.reset();
+        font_size.reset();
+        font_family.reset();
+        font_weight.reset();
+        data.reset();
+    }
+};
+
+// Ожидаемый вид значения поля для сообщений об ошибках
+constexpr std::string_view EXPECTED_NUMBER = "a number"sv;
+constexpr std::string_view EXPECTED_STRING = "a string"sv;
+constexpr std::string_view EXPECTED_POINT = "a point [x, y]"sv;
+constexpr std::string_view EXPECTED_POINTS = "an array of [x, y] points"sv;
+constexpr std::string_view EXPECTED_COLOR = "a color string, [r, g, b] or [r, g, b, opacity]"sv;
+constexpr std::string_view EXPECTED_FONT_SIZE = "a non-negative integer"sv;
+constexpr std::string_view EXPECTED_LINE_CAP = "one of butt, round, square"sv;
+constexpr std::string_view EXPECTED_LINE_JOIN = "one of arcs, bevel, miter, miter-clip, round"sv;
+
+std::string_view ExpectedValue(std::string_view field) {
+    if (field == "center"sv || field == "position"sv || field == "offset"sv) {
+        return EXPECTED_POINT;
+    } else if (field == "points"sv) {
+        return EXPECTED_POINTS;
+    } else if (field == "fill"sv || field == "stroke"sv) {
+        return EXPECTED_COLOR;
+    } else if (field == "radius"sv || field == "stroke_width"sv) {
+        return EXPECTED_NUMBER;
+    } else if (field == "font_size"sv) {
+        return EXPECTED_FONT_SIZE;
+    } else if (field == "stroke_linecap"sv) {
+        return EXPECTED_LINE_CAP;
+    } else if (field == "stroke_linejoin"sv) {
+        return EXPECTED_LINE_JOIN;
+    }
+    return EXPECTED_STRING;
+}
+
+[[noreturn]] void FieldError(std::string_view field, std::string_view expected) {
+    throw SceneError("scene: field \""s + std::string(field) + "\" must be "s + std::string(expected));
+}
+
+uint8_t ColorComponent(std::string_view field, double value) {
+    if (value < 0 || value > 255 || value != std::floor(value)) {
+        FieldError(field, "a color with integer components 0..255"sv);
+    }
+    return static_cast<uint8_t>(value);
+}
+
+Color ToColor(std::string_view field, FieldValue& value) {
+    if (value.kind == FieldValue::Kind::STRING) {
+        return std::move(value.string);
+    }
+    if (value.kind == FieldValue::Kind::ARRAY && !value.nested
+        && (value.numbers.size() == 3 || value.numbers.size() == 4)) {
+        const auto& c = value.numbers;
+        const uint8_t red = ColorComponent(field, c[0]);
+        const uint8_t green = ColorComponent(field, c[1]);
+        const uint8_t blue = ColorComponent(field, c[2]);
+        if (c.size() == 3) {
+            return Rgb(red, green, blue);
+        }
+        if (c[3] < 0.0 || c[3] > 1.0) {
+            FieldError(field, "a color with opacity 0..1"sv);
+        }
+        return Rgba(red, green, blue, c[3]);
+    }
+    FieldError(field, EXPECTED_COLOR);
+}
+
+Point ToPoint(std::string_view field, const FieldValue& value) {
+    if (value.kind != FieldValue::Kind::ARRAY || value.nested || value.numbers.size() != 2) {
+        FieldError(field, EXPECTED_POINT);
+    }
+    return {value.numbers[0], value.numbers[1]};
+}
+
+double ToNumber(std::string_view field, const FieldValue& value) {
+    if (value.kind != FieldValue::Kind::NUMBER && value.kind != FieldValue::Kind::INTEGER) {
+        FieldError(field, EXPECTED_NUMBER);
+    }
+    return value.number;
+}
+
+std::string ToString(std::string_view field, FieldValue& value) {
+    if (value.kind != FieldValue::Kind::STRING) {
+        FieldError(field, EXPECTED_STRING);
+    }
+    return std::move(value.string);
+}
+
+StrokeLineCap ToLineCap(std::string_view field, FieldValue& value) {
+    const std::string name = ToString(field, value);
+    if (name == "butt"sv) {
+        return StrokeLineCap::BUTT;
+    } else if (name == "round"sv) {
+        return StrokeLineCap::ROUND;
+    } else if (name == "square"sv) {
+        return StrokeLineCap::SQUARE;
+    }
+    FieldError(field, EXPECTED_LINE_CAP);
+}
+
+StrokeLineJoin ToLineJoin(std::string_view field, FieldValue& value) {
+    const std::string name = ToString(field, value);
+    if (name == "arcs"sv) {
+        return StrokeLineJoin::ARCS;
+    } else if (name == "bevel"sv) {
+        return StrokeLineJoin::BEVEL;
+    } else if (name == "miter"sv) {
+        return StrokeLineJoin::MITER;
+    } else if (name == "miter-clip"sv) {
+        return StrokeLineJoin::MITER_CLIP;
+    } else if (name == "round"sv) {
+        return StrokeLineJoin::ROUND;
+    }
+    FieldError(field, EXPECTED_LINE_JOIN);
+}
+
+// Принимает события json::Parse и отдаёт готовые фигуры в контейнер.
+// Помнит только поля текущего объекта, поэтому память не растёт со сценой
+class SceneBuilder final : public json::Handler {
+public:
+    explicit SceneBuilder(ObjectContainer& container)
+        : container_(container) {
+    }
+
+    void Null() override {
+        if (Skipped(0)) {
+            return;
+        }
+        if (state_ == State::ROOT_VALUE) {
+            state_ = State::ROOT;
+            return;
+        }
+        // null равносилен отсутствию поля
+        ExpectFieldValue();
+        state_ = State::OBJECT;
+    }
+
+    void Bool(bool value) override {
+        (void)value;
+        if (Skipped(0)) {
+            return;
+        }
+        Unexpected("bool"sv);
+    }
+
+    void Int(int value) override {
+        Number(value, FieldValue::Kind::INTEGER);
+    }
+
+    void Double(double value) override {
+        Number(value, FieldValue::Kind::NUMBER);
+    }
+
+    void String(std::string_view value) override {
+        if (Skipped(0)) {
+            return;
+        }
+        ExpectFieldValue();
+        value_.kind = FieldValue::Kind::STRING;
+        value_.string.assign(value);
+        ApplyField();
+    }
+
+    void StartArray() override {
+        if (Skipped(1)) {
+            return;
+        }
+        switch (state_) {
+            case State::START:
+                root_is_array_ = true;
+                state_ = State::OBJECTS;
+                break;
+            case State::ROOT_VALUE:
+                state_ = State::OBJECTS;
+                break;
+            case State::FIELD:
+                value_.kind = FieldValue::Kind::ARRAY;
+                array_depth_ = 1;
+                state_ = State::FIELD_ARRAY;
+                break;
+            case State::FIELD_ARRAY:
+                if (array_depth_ == 2) {
+                    FieldError(field_, ExpectedValue(field_));
+                }
+                ++array_depth_;
+                value_.nested = true;
+                inner_start_ = value_.numbers.size();
+                break;
+            default:
+                Unexpected("array"sv);
+        }
+    }
+
+    void EndArray() override {
+        if (Skipped(-1)) {
+            return;
+        }
+        if (state_ == State::OBJECTS) {
+            state_ = root_is_array_ ? State::DONE : State::ROOT;
+            return;
+        }
+        // Других незакрытых массивов вне полей быть не может
+        if (--array_depth_ == 1) {
+            value_.inner_sizes.push_back(value_.numbers.size() - inner_start_);
+            return;
+        }
+        ApplyField();
+    }
+
+    void StartDict() override {
+        if (Skipped(1)) {
+            return;
+        }
+        switch (state_) {
+            case State::START:
+                state_ = State::ROOT;
+                break;
+            case State::OBJECTS:
+                object_.Clear();
+                state_ = State::OBJECT;
+                break;
+            default:
+                Unexpected("dict"sv);
+        }
+    }
+
+    void Key(std::string_view key) override {
+        if (Skipped(0)) {
+            return;
+        }
+        if (state_ == State::ROOT) {
+            if (key == "objects"sv) {
+                state_ = State::ROOT_VALUE;
+            } else {
+                skip_depth_ = 0;
+                skipping_ = true;
+            }
+            return;
+        }
+        field_.assign(key);
+        value_.Clear();
+        state_ = State::FIELD;
+        if (!IsKnownField(key)) {
+            skip_depth_ = 0;
+            skipping_ = true;
+            state_ = State::OBJECT;
+        }
+    }
+
+    void EndDict() override {
+        if (Skipped(-1)) {
+            return;
+        }
+        if (state_ == State::ROOT) {
+            state_ = State::DONE;
+            return;
+        }
+        FinishObject();
+        state_ = State::OBJECTS;
+    }
+
+    void CheckComplete() const {
+        if (state_ != State::DONE) {
+            throw SceneError("scene: expected a dict with \"objects\" or an array of objects"s);
+        }
+    }
+
+private:
+    enum class State {
+        START,
+        // Внутри корневого словаря
+        ROOT,
+        // Ожидается значение ключа "objects"
+        ROOT_VALUE,
+        // Внутри массива объектов
+        OBJECTS,
+        // Внутри словаря объекта
+        OBJECT,
+        // Ожидается значение поля объекта
+        FIELD,
+        FIELD_ARRAY,
+        DONE,
+    };
+
+    ObjectContainer& container_;
+    State state_ = State::START;
+    bool root_is_array_ = false;
+    // Пропуск значения неизвестного ключа любой вложенности
+    bool skipping_ = false;
+    int skip_depth_ = 0;
+
+    SceneObject object_;
+    std::string field_;
+    FieldValue value_;
+    int array_depth_ = 0;
+    size_t inner_start_ = 0;
+
+    static bool IsKnownField(std::string_view key) {
+        static constexpr std::string_view FIELDS[] = {
+            "type"sv, "center"sv, "radius"sv, "points"sv, "position"sv, "offset"sv,
+            "font_size"sv, "font_family"sv, "font_weight"sv, "data"sv,
+            "fill"sv, "stroke"sv, "stroke_width"sv, "stroke_linecap"sv, "stroke_linejoin"sv,
+        };
+        for (const auto field : FIELDS) {
+            if (field == key) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // true, если событие относится к пропускаемому значению. nesting: +1 для
+    // начала массива или словаря, -1 для конца, 0 для скаляра
+    bool Skipped(int nesting) {
+        if (!skipping_) {
+            return false;
+        }
+        skip_depth_ += nesting;
+        if (skip_depth_ == 0) {
+            skipping_ = false;
+        }
+        return true;
+    }
+
+    void Number(double value, FieldValue::Kind kind) {
+        if (Skipped(0)) {
+            return;
+        }
+        if (state_ == State::FIELD_ARRAY) {
+            value_.numbers.push_back(value);
+            return;
+        }
+        ExpectFieldValue();
+        value_.kind = kind;
+        value_.number = value;
+        ApplyField();
+    }
+
+    void ExpectFieldValue() {
+        if (state_ != State::FIELD) {
+            Unexpected("value"sv);
+        }
+    }
+
+    [[noreturn]] void Unexpected(std::string_view what) const {
+        if (state_ == State::FIELD || state_ == State::FIELD_ARRAY) {
+            FieldError(field_, ExpectedValue(field_));
+        }
+        throw SceneError("scene: unexpected "s + std::string(what)
+                         + ", expected a dict with \"objects\" or an array of object dicts"s);
+    }
+
+    void ApplyField() {
+        state_ = State::OBJECT;
+        const std::string_view field = field_;
+        if (field == "type"sv) {
+            object_.type = ToString(field, value_);
+        } else if (field == "center"sv) {
+            object_.center = ToPoint(field, value_);
+        } else if (field == "radius"sv) {
+            object_.radius = ToNumber(field, value_);
+        } else if (field == "points"sv) {
+            ApplyPoints();
+        } else if (field == "position"sv) {
+            object_.position = ToPoint(field, value_);
+        } else if (field == "offset"sv) {
+            object_.offset = ToPoint(field, value_);
+        } else if (field == "font_size"sv) {
+            const double size = ToNumber(field, value_);
+            if (value_.kind != FieldValue::Kind::INTEGER || size < 0) {
+                FieldError(field, EXPECTED_FONT_SIZE);
+            }
+            object_.font_size = static_cast<uint32_t>(size);
+        } else if (field == "font_family"sv) {
+            object_.font_family = ToString(field, value_);
+        } else if (field == "font_weight"sv) {
+            object_.font_weight = ToString(field, value_);
+        } else if (field == "data"sv) {
+            object_.data = ToString(field, value_);
+        } else if (field == "fill"sv) {
+            object_.style.fill_color = ToColor(field, value_);
+        } else if (field == "stroke"sv) {
+            object_.style.stroke_color = ToColor(field, value_);
+        } else if (field == "stroke_width"sv) {
+            object_.style.stroke_width = ToNumber(field, value_);
+        } else if (field == "stroke_linecap"sv) {
+            object_.style.stroke_line_cap = ToLineCap(field, value_);
+        } else if (field == "stroke_linejoin"sv) {
+            object_.style.stroke_line_join = ToLineJoin(field, value_);
+        }
+    }
+
+    void ApplyPoints() {
+        const bool pairs = value_.kind == FieldValue::Kind::ARRAY
+            && (value_.numbers.empty() || value_.nested)
+            && value_.inner_sizes.size() * 2 == value_.numbers.size();
+        if (!pairs || std::find_if(value_.inner_sizes.begin(), value_.inner_sizes.end(), [](size_t size) {
+                return size != 2;
+            }) != value_.inner_sizes.end()) {
+            FieldError(field_, EXPECTED_POINTS);
+        }
+        object_.points.clear();
+        for (size_t i = 0; i < value_.numbers.size(); i += 2) {
+            object_.points.emplace_back(value_.numbers[i], value_.numbers[i + 1]);
+        }
+    }
+
+    template <typename Owner>
+    static void ApplyStyle(PathProps<Owner>& shape, const PathStyle& style) {
+        if (style.fill_color) {
+            shape.SetFillColor(*style.fill_color);
+        }
+        if (style.stroke_color) {
+            shape.SetStrokeColor(*style.stroke_color);
+        }
+        if (style.stroke_width) {
+            shape.SetStrokeWidth(*style.stroke_width);
+        }
+        if (style.stroke_line_cap) {
+            shape.SetStrokeLineCap(*style.stroke_line_cap);
+        }
+        if (style.stroke_line_join) {
+            shape.SetStrokeLineJoin(*style.stroke_line_join);
+        }
+    }
+
+    void FinishObject() {
+        if (object_.type == "circle"sv) {
+            Circle circle;
+            circle.SetCenter(object_.center.value_or(Point{}));
+            if (object_.radius) {
+                circle.SetRadius(*object_.radius);
+            }
+            ApplyStyle(circle, object_.style);
+            container_.Add(std::move(circle));
+        } else if (object_.type == "polyline"sv) {
+            Polyline polyline;
+            for (const Point point : object_.points) {
+                polyline.AddPoint(point);
+            }
+            ApplyStyle(polyline, object_.style);
+            container_.Add(std::move(polyline));
+        } else if (object_.type == "text"sv) {
+            Text text;
+            text.SetPosition(object_.position.value_or(Point{}));
+            text.SetOffset(object_.offset.value_or(Point{}));
+            if (object_.font_size) {
+                text.SetFontSize(*object_.font_size);
+            }
+            if (object_.font_family) {
+                text.SetFontFamily(std::move(*object_.font_family));
+            }
+            if (object_.font_weight) {
+                text.SetFontWeight(std::move(*object_.font_weight));
+            }
+            if (object_.data) {
+                text.SetData(std::move(*object_.data));
+            }
+            ApplyStyle(text, object_.style);
+            container_.Add(std::move(text));
+        } else {
+            throw SceneError("scene: unknown object type \""s + object_.type
+                             + "\", expected circle, polyline or text"s);
+        }
+    }
+};
+
+}  // namespace
+
+void LoadScene(std::istream& input, ObjectContainer& container) {
+    SceneBuilder builder(container);
+    json::Parse(input, builder);
+    builder.CheckComplete();
+}
+
+void RenderScene(std::istream& input, std::ostream& output, const RenderOptions& options) {
+    StreamWriter writer(output, options);
+    LoadScene(input, writer);
+    writer.Close();
+}
+
+void RenderScene(std::istream& input, OutputSink& output, const RenderOptions& options) {
+    StreamWriter writer(output, options);
+    LoadScene(input, writer);
+    writer.Close();
+}
+
+}  // namespace svg
@@ -0,0 +1,48 @@
+#pragma once
+
+// Потоковое преобразование JSON-описания сцены в SVG. Текст разбирается
+// событиями json::Parse, каждый объект сцены превращается в фигуру svg
+// сразу по окончании своего словаря, и ни дерево json::Node, ни
+// svg::Document целиком не строятся.
+//
+// Сцена - словарь с массивом "objects" (остальные ключи пропускаются) или
+// сам массив объектов:
+//
+//     {"objects": [
+//         {"type": "circle", "center": [50, 50], "radius": 10, "fill": "red"},
+//         {"type": "polyline", "points": [[0, 0], [10, 5]], "stroke": [0, 0, 255],
+//          "stroke_width": 2, "stroke_linecap": "round", "stroke_linejoin": "bevel"},
+//         {"type": "text", "position": [5, 5], "offset": [1, -1], "font_size": 12,
+//          "font_family": "Verdana", "font_weight": "bold", "data": "Hi",
+//          "fill": [255, 255, 255, 0.85]}
+//     ]}
+//
+// Цвет - строка, [r, g, b] или [r, g, b, opacity]; null у любого поля
+// равносилен его отсутствию. Неизвестные поля пропускаются
+
+#include "json.hpp"
+#include "svg.hpp"
+
+#include <istream>
+#include <ostream>
+#include <stdexcept>
+
+namespace svg {
+
+// Синтаксически верный JSON, не описывающий сцену
+class SceneError : public std::runtime_error {
+public:
+    using runtime_error::runtime_error;
+};
+
+// Добавляет объекты сцены в container по мере разбора
+void LoadScene(std::istream& input, ObjectContainer& container);
+
+// Сцена сразу в SVG через StreamWriter: память не зависит от размера сцены.
+// При ошибке разбора вывод обрывается без </svg>, а Finish у приёмника не
+// вызывается, так что неполная сцена не выглядит законченным документом
+void RenderScene(std::istream& input, std::ostream& output, const RenderOptions& options = {});
+
+void RenderScene(std::istream& input, OutputSink& output, const RenderOptions& options = {});
+
+}  // namespace svg
@@ -0,0 +1,181 @@
+// Проверки потокового разбора JSON (json::Parse) и построения сцены из его
+// событий. Отдельная программа без зависимостей:
+//     g++ -std=c++17 svg_scene_test.cpp svg_scene.cpp svg.cpp json.cpp -pthread
+// Код возврата - число не прошедших проверок
+
+#include "svg_scene.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+
+using namespace std::literals;
+
+namespace {
+
+int failures = 0;
+
+void Check(bool condition, std::string_view what) {
+    if (!condition) {
+        ++failures;
+        std::cerr << "FAILED: " << what << '\n';
+    }
+}
+
+// Записывает события разбора одной строкой: s:<строка> i:<целое> [ ] { } k:<ключ>
+class Recorder final : public json::Handler {
+public:
+    std::string events;
+
+    void Null() override {
+        events += "null "s;
+    }
+
+    void Bool(bool value) override {
+        events += value ? "true "s : "false "s;
+    }
+
+    void Int(int value) override {
+        events += "i:"s + std::to_string(value) + " "s;
+    }
+
+    void Double(double value) override {
+        std::ostringstream out;
+        out << value;
+        events += "d:"s + out.str() + " "s;
+    }
+
+    void String(std::string_view value) override {
+        events += "s:"s + std::string(value) + " "s;
+    }
+
+    void StartArray() override {
+        events += "[ "s;
+    }
+
+    void EndArray() override {
+        events += "] "s;
+    }
+
+    void StartDict() override {
+        events += "{ "s;
+    }
+
+    void Key(std::string_view key) override {
+        events += "k:"s + std::string(key) + " "s;
+    }
+
+    void EndDict() override {
+        events += "} "s;
+    }
+};
+
+std::string ParseEvents(const std::string& text, size_t max_depth = json::DEFAULT_MAX_DEPTH) {
+    std::istringstream input(text);
+    Recorder recorder;
+    json::Parse(input, recorder, max_depth);
+    return recorder.events;
+}
+
+bool ParseFails(const std::string& text, size_t max_depth = json::DEFAULT_MAX_DEPTH) {
+    try {
+        ParseEvents(text, max_depth);
+    } catch (const json::ParsingError&) {
+        return true;
+    }
+    return false;
+}
+
+std::string Render(const std::string& scene) {
+    std::istringstream input(scene);
+    std::ostringstream output;
+    svg::RenderScene(input, output);
+    return output.str();
+}
+
+// Текст SceneError или пустая строка, если сцена разобралась
+std::string SceneErrorText(const std::string& scene) {
+    try {
+        Render(scene);
+    } catch (const svg::SceneError& error) {
+        return error.what();
+    }
+    return {};
+}
+
+void TestEscapes() {
+    Check(ParseEvents(R"("a\"b\\c\/d\b\f\n\r\t")") == "s:a\"b\\c/d\b\f\n\r\t "s, "simple escapes");
+    Check(ParseEvents(R"("\u0041\u00e9\u20ac")") == "s:A\xC3\xA9\xE2\x82\xAC "s, "\\u escapes to UTF-8");
+    Check(ParseFails(R"("\x")"), "unknown escape is rejected");
+    Check(ParseFails(R"("\u12G4")"), "bad hex digit is rejected");
+}
+
+void TestSurrogatePairs() {
+    Check(ParseEvents(R"("\ud83d\ude00")") == "s:\xF0\x9F\x98\x80 "s, "surrogate pair");
+    Check(ParseFails(R"("\ud83d")"), "lone high surrogate is rejected");
+    Check(ParseFails(R"("\ude00")"), "lone low surrogate is rejected");
+    Check(ParseFails(R"("\ud83d\u0041")"), "high surrogate with a non-surrogate is rejected");
+}
+
+void TestControlCharacters() {
+    Check(ParseFails("\"a\nb\""s), "raw newline is rejected");
+    Check(ParseFails("\"a\tb\""s), "raw tab is rejected");
+    Check(ParseFails("\"a\x01" "b\""s), "raw control byte is rejected");
+    Check(ParseEvents("\"a\x7F\""s) == "s:a\x7F "s, "DEL is allowed");
+}
+
+void TestDepthLimit() {
+    const std::string nested = "[[[{\"a\":[1]}]]]"s;
+    Check(ParseEvents(nested, 5) == "[ [ [ { k:a [ i:1 ] } ] ] ] "s, "nesting at the limit");
+    Check(ParseFails(nested, 4), "nesting beyond the limit");
+    Check(ParseFails(std::string(1'000'000, '[')), "deep input fails instead of overflowing the stack");
+    Check(!ParseFails("[[], [], []]"s, 2), "depth is counted per branch");
+}
+
+void TestSceneSkipping() {
+    // Неизвестные ключи с вложенными значениями любой глубины пропускаются
+    const std::string scene = R"({
+        "meta": {"a": [1, {"b": [[2], {"objects": "not these"}]}], "c": null},
+        "objects": [
+            {"type": "circle", "extra": [{"x": [1, [2, 3]]}, {}], "center": [1, 2], "radius": 3},
+            {"type": "text", "note": {"deep": [[[]]]}, "data": "Hi"}
+        ],
+        "after": [[{"objects": []}]]
+    })";
+    const std::string svg = Render(scene);
+    Check(svg.find("<circle cx=\"1\" cy=\"2\" r=\"3\"/>"sv) != std::string::npos, "circle after skipped keys");
+    Check(svg.find(">Hi</text>"sv) != std::string::npos, "text after skipped keys");
+}
+
+void TestSceneErrors() {
+    Check(SceneErrorText(R"([{"type": "circle", "center": [1, "x"]}])")
+              == "scene: field \"center\" must be a point [x, y]"s,
+          "string inside a point");
+    Check(SceneErrorText(R"([{"type": "polyline", "points": [[0, 0], [1, true]]}])")
+              == "scene: field \"points\" must be an array of [x, y] points"s,
+          "bool inside points");
+    Check(SceneErrorText(R"([{"type": "circle", "fill": [255, {}, 0]}])")
+              == "scene: field \"fill\" must be a color string, [r, g, b] or [r, g, b, opacity]"s,
+          "dict inside a color");
+    Check(SceneErrorText(R"([{"type": "circle", "radius": [1]}])") == "scene: field \"radius\" must be a number"s,
+          "array instead of a number");
+    Check(SceneErrorText(R"([{"type": "square"}])")
+              == "scene: unknown object type \"square\", expected circle, polyline or text"s,
+          "unknown type");
+}
+
+}  // namespace
+
+int main() {
+    TestEscapes();
+    TestSurrogatePairs();
+    TestControlCharacters();
+    TestDepthLimit();
+    TestSceneSkipping();
+    TestSceneErrors();
+    if (failures == 0) {
+        std::cout << "OK\n";
+    }
+    return failures;
+}